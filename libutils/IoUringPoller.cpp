@@ -0,0 +1,248 @@
+//
+// Copyright 2026 The Android Open Source Project
+//
+// Polls file descriptors through io_uring.
+//
+#define LOG_TAG "IoUringPoller"
+
+#include "IoUringPoller.h"
+
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace android {
+
+namespace {
+
+// The user data of poll removals, whose completions we are not interested in.
+constexpr uint64_t REMOVE_USER_DATA = UINT64_MAX;
+
+// EXT_ARG gives io_uring_enter() a timeout without a timeout request, NODROP keeps
+// completions that do not fit in the ring instead of losing them, and RSRC_TAGS came with
+// multishot polls in Linux 5.13.
+constexpr uint32_t REQUIRED_FEATURES = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP
+        | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+
+template <typename T>
+T* ringPointer(void* ring, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+}  // namespace
+
+std::unique_ptr<IoUringPoller> IoUringPoller::create(unsigned entries) {
+    io_uring_params params = {};
+    android::base::unique_fd ringFd(syscall(__NR_io_uring_setup, entries, &params));
+    if (ringFd.get() < 0) {
+        ALOGW("io_uring is unavailable: %s", strerror(errno));
+        return nullptr;
+    }
+    if ((params.features & REQUIRED_FEATURES) != REQUIRED_FEATURES) {
+        ALOGW("io_uring lacks required features, has 0x%x", params.features);
+        return nullptr;
+    }
+
+    std::unique_ptr<IoUringPoller> poller(new IoUringPoller());
+    poller->mRingSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    poller->mRing = mmap(nullptr, poller->mRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd.get(), IORING_OFF_SQ_RING);
+    if (poller->mRing == MAP_FAILED) {
+        poller->mRing = nullptr;
+        ALOGE("Could not map io_uring rings: %s", strerror(errno));
+        return nullptr;
+    }
+    poller->mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, poller->mSqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd.get(), IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ALOGE("Could not map io_uring submission entries: %s", strerror(errno));
+        return nullptr;
+    }
+    poller->mSqes = static_cast<io_uring_sqe*>(sqes);
+
+    void* ring = poller->mRing;
+    poller->mSqHead = ringPointer<std::atomic<uint32_t>>(ring, params.sq_off.head);
+    poller->mSqTail = ringPointer<std::atomic<uint32_t>>(ring, params.sq_off.tail);
+    poller->mSqFlags = ringPointer<std::atomic<uint32_t>>(ring, params.sq_off.flags);
+    poller->mSqMask = *ringPointer<uint32_t>(ring, params.sq_off.ring_mask);
+    poller->mSqEntries = params.sq_entries;
+    poller->mCqHead = ringPointer<std::atomic<uint32_t>>(ring, params.cq_off.head);
+    poller->mCqTail = ringPointer<std::atomic<uint32_t>>(ring, params.cq_off.tail);
+    poller->mCqMask = *ringPointer<uint32_t>(ring, params.cq_off.ring_mask);
+    poller->mCqes = ringPointer<io_uring_cqe>(ring, params.cq_off.cqes);
+
+    // Submission entries are used in ring order, so the indirection array is the identity.
+    uint32_t* array = ringPointer<uint32_t>(ring, params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    poller->mSkipRemoveCompletions = params.features & IORING_FEAT_CQE_SKIP;
+    poller->mRingFd = std::move(ringFd);
+    return poller;
+}
+
+IoUringPoller::~IoUringPoller() {
+    if (mSqes != nullptr) {
+        munmap(mSqes, mSqesSize);
+    }
+    if (mRing != nullptr) {
+        munmap(mRing, mRingSize);
+    }
+}
+
+bool IoUringPoller::queuePoll(int fd, uint32_t events, uint64_t userData, bool multishot) {
+    io_uring_sqe* sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = userData;
+    mSqTail->store(mSqTail->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    return true;
+}
+
+bool IoUringPoller::queueRemove(uint64_t userData) {
+    io_uring_sqe* sqe = getSqe();
+    if (sqe == nullptr) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->flags = mSkipRemoveCompletions ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    sqe->user_data = REMOVE_USER_DATA;
+    mSqTail->store(mSqTail->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    return true;
+}
+
+io_uring_sqe* IoUringPoller::getSqe() {
+    const uint32_t tail = mSqTail->load(std::memory_order_relaxed);
+    if (tail - mSqHead->load(std::memory_order_acquire) == mSqEntries) {
+        // The ring is full of queued requests, hand them over to make room.
+        if (!submit() || tail - mSqHead->load(std::memory_order_acquire) == mSqEntries) {
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &mSqes[tail & mSqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool IoUringPoller::submit() {
+    const uint32_t toSubmit = mSqTail->load(std::memory_order_relaxed)
+            - mSqHead->load(std::memory_order_acquire);
+    if (toSubmit == 0) {
+        return true;
+    }
+    mSubmitSyscallCount++;
+    if (enter(toSubmit, 0, 0, nullptr, 0) < 0) {
+        ALOGE("Could not submit io_uring requests: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int IoUringPoller::enter(unsigned toSubmit, unsigned minComplete, unsigned flags,
+        const void* arg, size_t argSize) {
+    return syscall(__NR_io_uring_enter, mRingFd.get(), toSubmit, minComplete, flags, arg,
+            argSize);
+}
+
+int IoUringPoller::wait(Event* events, int maxEvents, nsecs_t timeoutNanos,
+        std::vector<uint64_t>* outEndedPolls) {
+    const nsecs_t deadline = timeoutNanos > 0
+            ? systemTime(SYSTEM_TIME_MONOTONIC) + timeoutNanos : 0;
+    for (;;) {
+        // Submit and wait in one call, or only submit when we would not wait anyway.
+        // Entering also flushes the completions that overflowed the ring.
+        const uint32_t toSubmit = mSqTail->load(std::memory_order_acquire)
+                - mSqHead->load(std::memory_order_acquire);
+        const bool haveCompletions = mCqTail->load(std::memory_order_acquire)
+                != mCqHead->load(std::memory_order_relaxed);
+        const bool overflowed =
+                mSqFlags->load(std::memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW;
+        bool timedOut = timeoutNanos == 0;
+        if (!haveCompletions && timeoutNanos != 0) {
+            __kernel_timespec timeout = {.tv_sec = timeoutNanos / 1000000000,
+                                         .tv_nsec = timeoutNanos % 1000000000};
+            io_uring_getevents_arg arg = {};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = timeoutNanos < 0 ? 0 : reinterpret_cast<uint64_t>(&timeout);
+            mWaitSyscallCount++;
+            if (enter(toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                    sizeof(arg)) < 0) {
+                if (errno != ETIME) {
+                    return -1;
+                }
+                timedOut = true;
+            }
+        } else if (toSubmit != 0 || overflowed) {
+            mWaitSyscallCount++;
+            if (enter(toSubmit, 0, overflowed ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+                return -1;
+            }
+        }
+
+        const size_t endedPollCount = outEndedPolls->size();
+        const int count = reap(events, maxEvents, outEndedPolls);
+        if (count != 0 || outEndedPolls->size() != endedPollCount || timedOut) {
+            return count;
+        }
+
+        // Only completions of removals and cancelled polls came in, keep waiting.
+        if (timeoutNanos > 0) {
+            timeoutNanos = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (timeoutNanos <= 0) {
+                return 0;
+            }
+        }
+    }
+}
+
+int IoUringPoller::reap(Event* events, int maxEvents,
+        std::vector<uint64_t>* outEndedPolls) {
+    // Completions beyond maxEvents stay in the ring for the next call.
+    uint32_t head = mCqHead->load(std::memory_order_relaxed);
+    const uint32_t tail = mCqTail->load(std::memory_order_acquire);
+    int count = 0;
+    for (; head != tail && count < maxEvents; head++) {
+        const io_uring_cqe& cqe = mCqes[head & mCqMask];
+        if (cqe.user_data == REMOVE_USER_DATA) {
+            continue;
+        }
+        if (cqe.res == -ECANCELED || cqe.res == -ENOENT) {
+            // Cancelled by a removal, there is nothing to report or to queue again.
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            outEndedPolls->push_back(cqe.user_data);
+        }
+        if (cqe.res < 0) {
+            // The poll failed, report it rather than letting the registration go quiet.
+            events[count++] = {.userData = cqe.user_data,
+                               .events = static_cast<uint32_t>(
+                                       cqe.res == -EBADF ? POLLNVAL : POLLERR)};
+        } else if (cqe.res != 0) {
+            events[count++] = {.userData = cqe.user_data,
+                               .events = static_cast<uint32_t>(cqe.res)};
+        }
+    }
+    mCqHead->store(head, std::memory_order_release);
+    return count;
+}
+
+} // namespace android
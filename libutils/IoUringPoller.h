@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_IO_URING_POLLER_H
+#define ANDROID_IO_URING_POLLER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <utils/Timers.h>
+#include <utils/unique_fd.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// ---------------------------------------------------------------------------
+
+namespace android {
+
+/*
+ * Waits for file descriptor readiness with io_uring poll requests, talking to the kernel
+ * through the raw system calls.
+ *
+ * Requests are queued in the submission ring and reach the kernel with the next
+ * submit() or wait(), so that any number of them costs at most one system call.
+ * Readiness is reported as poll(2) events, with the user data of the request.
+ *
+ * Requests may be queued from any thread as long as the caller serializes them, wait()
+ * must only be called from one thread at a time.
+ */
+class IoUringPoller
+{
+public:
+    /* The readiness reported by a poll. */
+    struct Event {
+        uint64_t userData;  // of the poll request
+        uint32_t events;    // POLL* flags, POLLERR or POLLNVAL if the poll failed
+    };
+
+    /* Returns nullptr if io_uring is unavailable or lacks the features we need. */
+    static std::unique_ptr<IoUringPoller> create(unsigned entries);
+
+    ~IoUringPoller();
+
+    /* Queues a poll of fd for the given POLLIN / POLLOUT events.  A multishot poll
+     * reports every time the fd becomes ready until it is removed, otherwise the poll
+     * reports once.  Returns false if the request could not be queued. */
+    bool queuePoll(int fd, uint32_t events, uint64_t userData, bool multishot);
+
+    /* Queues the removal of the poll with the given user data. */
+    bool queueRemove(uint64_t userData);
+
+    /* Hands the queued requests to the kernel.  Returns false on error. */
+    bool submit();
+
+    /* Submits the queued requests and waits up to timeoutNanos, or forever if it is
+     * negative, for readiness.  Returns the number of events stored, or -1 with errno set.
+     * The user data of polls that ended, having reported once, failed or been terminated by
+     * the kernel, are appended to outEndedPolls, since they need to be queued again to report
+     * any further readiness.  Completions of removals and of the polls they cancelled do
+     * not end the wait. */
+    int wait(Event* events, int maxEvents, nsecs_t timeoutNanos,
+            std::vector<uint64_t>* outEndedPolls);
+
+    /* The number of io_uring_enter() calls made by submit(), including those made to
+     * make room when queueing, and by wait(). */
+    uint64_t getSubmitSyscallCount() const { return mSubmitSyscallCount; }
+    uint64_t getWaitSyscallCount() const { return mWaitSyscallCount; }
+
+private:
+    IoUringPoller() = default;
+
+    io_uring_sqe* getSqe();
+    int reap(Event* events, int maxEvents, std::vector<uint64_t>* outEndedPolls);
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, const void* arg,
+            size_t argSize);
+
+    android::base::unique_fd mRingFd;
+    bool mSkipRemoveCompletions = false;
+    uint64_t mSubmitSyscallCount = 0;  // serialized like the queueing of requests
+    uint64_t mWaitSyscallCount = 0;  // serialized like wait()
+
+    void* mRing = nullptr;
+    size_t mRingSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    size_t mSqesSize = 0;
+
+    // Submission ring, produced by us and consumed by the kernel.
+    std::atomic<uint32_t>* mSqHead = nullptr;
+    std::atomic<uint32_t>* mSqTail = nullptr;
+    std::atomic<uint32_t>* mSqFlags = nullptr;
+    uint32_t mSqMask = 0;
+    uint32_t mSqEntries = 0;
+
+    // Completion ring, produced by the kernel and consumed by us.
+    std::atomic<uint32_t>* mCqHead = nullptr;
+    std::atomic<uint32_t>* mCqTail = nullptr;
+    uint32_t mCqMask = 0;
+    io_uring_cqe* mCqes = nullptr;
+};
+
+} // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_IO_URING_POLLER_H
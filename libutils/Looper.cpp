@@ -18,8 +18,19 @@
 #endif
 
 #include <utils/Looper.h>
+#if HAVE_EVENTFD
 #include <sys/eventfd.h>
+#endif
+#include "PollBackend.h"
+#include <algorithm>
+#include <bit>
 #include <cinttypes>
+#include <limits.h>
+#include <pthread.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
 
 namespace android {
 
@@ -27,55 +38,61 @@ namespace {
 
 constexpr uint64_t WAKE_EVENT_FD_SEQ = 1;
 
-#if HAVE_EPOLL
-epoll_event createEpollEvent(uint32_t events, uint64_t seq) {
-    return {.events = events, .data = {.u64 = seq}};
+// The sequence number of an fd request holds the fd in its low 32 bits and the generation
+// of the fd's request slot in its high 32 bits.  Generations start at 1, so a request
+// sequence number is never WAKE_EVENT_FD_SEQ.
+constexpr uint64_t makeRequestSequenceNumber(int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
 }
-#elif HAVE_KQUEUE
-struct kevent createKqueueEvent(int fd, int16_t filter, uint64_t seq) {
-    struct kevent eventItem = {
-        .ident = static_cast<uintptr_t>(fd),
-        .filter = filter,
-        .flags = EV_ADD | EV_ENABLE,
-        .fflags = 0,
-        .data = 0,
-        .udata = reinterpret_cast<void*>(seq)
-    };
-    return eventItem;
-}
-Vector<struct kevent> createKqueueEvents(int fd, const Vector<int16_t>& filters, uint64_t seq) {
-    Vector<struct kevent> result;
-    for (int16_t filter : filters) {
-        struct kevent eventItem = {
-            .ident = static_cast<uintptr_t>(fd),
-            .filter = filter,
-            .flags = EV_ADD | EV_ENABLE,
-            .fflags = 0,
-            .data = 0,
-            .udata = reinterpret_cast<void*>(seq)
-        };
-        result.push_back(eventItem);
+
+constexpr int getRequestSequenceNumberFd(uint64_t seq) {
+    return static_cast<int>(static_cast<uint32_t>(seq));
+}
+
+// Heap comparator for the pending message queue.  std::*_heap keep the greatest
+// element at the front, so "greater" means due later, or sent later when due together.
+template <typename HeapEntry>
+bool isMessageDueAfter(const HeapEntry& a, const HeapEntry& b) {
+    return a.uptime != b.uptime ? a.uptime > b.uptime : a.seq > b.seq;
+}
+
+// The most heap entries that getMessageWakeupTimeLocked() keeps track of at once.
+constexpr size_t MAX_COALESCED_MESSAGES = 64;
+
+void checkMessagePriority(int priority) {
+    LOG_ALWAYS_FATAL_IF(priority < Looper::MESSAGE_PRIORITY_URGENT
+            || priority > Looper::MESSAGE_PRIORITY_BACKGROUND,
+            "Invalid message priority %d", priority);
+}
+
+// Rounds a timer deadline up to a multiple of its granularity, if it has one.
+nsecs_t roundUpToGranularity(nsecs_t deadline, nsecs_t granularity) {
+    if (granularity == 0) {
+        return deadline;
     }
-    return result;
+    return (deadline + granularity - 1) / granularity * granularity;
 }
 
-Vector<struct kevent> createKqueueEventsForDelete(int fd, uint64_t seq) {
-    Vector<struct kevent> result;
-    struct kevent eventItem = {
-        .ident = static_cast<uintptr_t>(fd),
-        .filter = EVFILT_READ,
-        .flags = EV_DELETE,
-        .fflags = 0,
-        .data = 0,
-        .udata = reinterpret_cast<void*>(seq)
-    };
-    result.push_back(eventItem);
-    eventItem.filter = EVFILT_WRITE;
-    result.push_back(eventItem);
-    return result;
+// Don't bother compacting the message heap until it holds at least this many tombstones.
+constexpr size_t MIN_MESSAGE_TOMBSTONES_TO_COMPACT = 64;
+
+// Don't bother rebuilding the poll set to get rid of registrations that outlived their fds
+// until there are at least this many of them.
+constexpr size_t MIN_STALE_REGISTRATIONS_TO_REBUILD = 64;
+
+// Adds to a counter that only a single thread writes, without a locked read-modify-write.
+template <typename T>
+void addToCounter(std::atomic<T>& counter, T delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
 }
 
-#endif
+// Raises a single-writer high-water mark.
+template <typename T>
+void maxToCounter(std::atomic<T>& counter, T value) {
+    if (value > counter.load(std::memory_order_relaxed)) {
+        counter.store(value, std::memory_order_relaxed);
+    }
+}
 
 }  // namespace
 
@@ -110,33 +127,145 @@ int SimpleLooperCallback::handleEvent(int fd, int events, void* data) {
 }
 
 
-// --- Looper ---
+// --- Looper::WakeChannel ---
+
+#if HAVE_EVENTFD
+// An eventfd: the counter of signals is reset by a single read.
 
-// Maximum number of file descriptors for which to retrieve poll events each iteration.
-#if HAVE_EPOLL
-static const int EPOLL_MAX_EVENTS = 16;
+Looper::WakeChannel::WakeChannel() {
+    mFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    LOG_ALWAYS_FATAL_IF(mFd.get() < 0, "Could not make wake event fd: %s", strerror(errno));
+}
+
+void Looper::WakeChannel::signal() {
+    if (TEMP_FAILURE_RETRY(eventfd_write(mFd.get(), 1)) != 0 && errno != EAGAIN) {
+        LOG_ALWAYS_FATAL("Could not write wake signal to fd %d: %s", mFd.get(), strerror(errno));
+    }
+}
+
+void Looper::WakeChannel::drain() {
+    eventfd_t counter;
+    TEMP_FAILURE_RETRY(eventfd_read(mFd.get(), &counter));
+}
 #elif HAVE_KQUEUE
-static const int KQUEUE_MAX_EVENTS = 16;
+// A kqueue of its own holding an EVFILT_USER event, which the looper's kqueue polls like
+// any other file descriptor.  Unlike a trigger registered directly on the looper's
+// kqueue, it survives rebuilds of that kqueue and can be signalled without mLock.
+
+namespace {
+constexpr uintptr_t WAKE_CHANNEL_IDENT = 0;
+}  // namespace
+
+Looper::WakeChannel::WakeChannel() {
+    mFd.reset(kqueue());
+    LOG_ALWAYS_FATAL_IF(mFd.get() < 0, "Could not make wake kqueue: %s", strerror(errno));
+    struct kevent eventItem;
+    EV_SET(&eventItem, WAKE_CHANNEL_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+    int result = kevent(mFd.get(), &eventItem, 1, nullptr, 0, nullptr);
+    LOG_ALWAYS_FATAL_IF(result < 0, "Could not add user event to wake kqueue: %s",
+                        strerror(errno));
+}
+
+void Looper::WakeChannel::signal() {
+    struct kevent eventItem;
+    EV_SET(&eventItem, WAKE_CHANNEL_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    if (TEMP_FAILURE_RETRY(kevent(mFd.get(), &eventItem, 1, nullptr, 0, nullptr)) < 0) {
+        LOG_ALWAYS_FATAL("Could not trigger wake kqueue %d: %s", mFd.get(), strerror(errno));
+    }
+}
+
+void Looper::WakeChannel::drain() {
+    // EV_CLEAR resets the trigger once it has been retrieved.
+    struct kevent eventItem;
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 0};
+    TEMP_FAILURE_RETRY(kevent(mFd.get(), nullptr, 0, &eventItem, 1, &timeout));
+}
+#else
+// A non-blocking self-pipe: each signal writes one byte, draining reads them all.
+
+Looper::WakeChannel::WakeChannel() {
+    int fds[2];
+    LOG_ALWAYS_FATAL_IF(pipe(fds) != 0, "Could not make wake pipe: %s", strerror(errno));
+    mFd.reset(fds[0]);
+    mWriteFd.reset(fds[1]);
+    for (int fd : fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+void Looper::WakeChannel::signal() {
+    // A full pipe is already signalled.
+    const char signal = 1;
+    if (TEMP_FAILURE_RETRY(write(mWriteFd.get(), &signal, 1)) < 0 && errno != EAGAIN) {
+        LOG_ALWAYS_FATAL("Could not write wake signal to fd %d: %s", mWriteFd.get(),
+                         strerror(errno));
+    }
+}
+
+void Looper::WakeChannel::drain() {
+    char buffer[64];
+    while (TEMP_FAILURE_RETRY(read(mFd.get(), buffer, sizeof(buffer))) == sizeof(buffer)) {
+    }
+}
 #endif
 
+
+// --- Looper ---
+
 thread_local static sp<Looper> gThreadLocalLooper;
 
-Looper::Looper(bool allowNonCallbacks)
+// The looper that the calling thread is polling, if any.  Registration changes it makes
+// on that looper are picked up by its next poll rather than flushed right away.
+thread_local static const Looper* gPollingLooper;
+
+// Sets gPollingLooper for the duration of a poll, restoring the looper the thread was
+// polling before in case we are polled from within another looper's callback.
+class PollingLooperScope {
+public:
+    explicit PollingLooperScope(const Looper* looper) : mPrevious(gPollingLooper) {
+        gPollingLooper = looper;
+    }
+    ~PollingLooperScope() { gPollingLooper = mPrevious; }
+
+private:
+    const Looper* const mPrevious;
+};
+
+Looper::Looper(bool allowNonCallbacks) : Looper(allowNonCallbacks, Options()) {
+}
+
+Looper::Looper(bool allowNonCallbacks, const Options& options)
     : mAllowNonCallbacks(allowNonCallbacks),
+      mOptions(options),
+      mMessageTombstones(0),
+      mPrioritizedMessageCount(0),
+      mNextMessageSeq(1),
+      mInbox(nullptr),
       mSendingMessage(false),
       mPolling(false),
+      mWakePending(false),
       mEpollRebuildRequired(false),
-      mNextRequestSeq(WAKE_EVENT_FD_SEQ + 1),
+      mRequestCount(0),
+      mDeferCallbackReleases(false),
       mResponseIndex(0),
-      mNextMessageUptime(LLONG_MAX) {
-    mWakeEventFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
-    LOG_ALWAYS_FATAL_IF(mWakeEventFd.get() < 0, "Could not make wake event fd: %s", strerror(errno));
+      mNextMessageUptime(LLONG_MAX),
+      mWatchdogCallbackThreshold(LLONG_MAX),
+      mWatchdogLatenessThreshold(LLONG_MAX) {
+    mEventItems.resize(std::max<size_t>(mOptions.eventBatchSize, 1));
+    mStats.eventBatchSize.store(mEventItems.size(), std::memory_order_relaxed);
 
     AutoMutex _l(mLock);
     rebuildEpollLocked();
 }
 
 Looper::~Looper() {
+    InboxMessage* inboxMessage = mInbox.exchange(nullptr, std::memory_order_acquire);
+    while (inboxMessage != nullptr) {
+        InboxMessage* next = inboxMessage->next;
+        delete inboxMessage;
+        inboxMessage = next;
+    }
 }
 
 void Looper::setForThread(const sp<Looper>& looper) {
@@ -161,62 +290,84 @@ sp<Looper> Looper::prepare(int opts) {
     return looper;
 }
 
+sp<Looper> Looper::prepareOnCpu(int cpu, int opts) {
+    if (cpu < 0) {
+        ALOGE("Invalid attempt to pin a looper thread to cpu %d.", cpu);
+        return nullptr;
+    }
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE) {
+        ALOGE("Invalid attempt to pin a looper thread to cpu %d.", cpu);
+        return nullptr;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (result != 0) {
+        ALOGE("Could not pin looper thread to cpu %d: %s", cpu, strerror(result));
+        return nullptr;
+    }
+#elif defined(__APPLE__)
+    // Tag 0 means no affinity, so shift the cpu numbers by one.
+    thread_affinity_policy_data_t policy = {.affinity_tag = cpu + 1};
+    mach_port_t thread = pthread_mach_thread_np(pthread_self());
+    kern_return_t result = thread_policy_set(thread, THREAD_AFFINITY_POLICY,
+            reinterpret_cast<thread_policy_t>(&policy), THREAD_AFFINITY_POLICY_COUNT);
+    if (result != KERN_SUCCESS) {
+        ALOGE("Could not set the affinity of looper thread to cpu %d: %d", cpu, result);
+        return nullptr;
+    }
+#else
+    ALOGE("Pinning a looper thread to a cpu is not supported on this platform.");
+    return nullptr;
+#endif
+    return prepare(opts);
+}
+
 bool Looper::getAllowNonCallbacks() const {
     return mAllowNonCallbacks;
 }
 
 void Looper::rebuildEpollLocked() {
-    // Close old epoll instance if we have one.
-#if HAVE_EPOLL
-    if (mEpollFd >= 0) {
+    // Replace the old backend instance if we have one.
+    int backendType = mOptions.pollBackend;
+    if (mBackend != nullptr) {
 #if DEBUG_CALLBACKS
-        ALOGD("%p ~ rebuildEpollLocked - rebuilding epoll set", this);
+        ALOGD("%p ~ rebuildEpollLocked - rebuilding poll set", this);
 #endif
-        mEpollFd.reset();
+        backendType = mBackend->getType();
+        mBackend.reset();
+        addToCounter(mStats.pollSetRebuildCount, uint64_t(1));
     }
-
-    // Allocate the new epoll instance and register the WakeEventFd.
-    mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
-    LOG_ALWAYS_FATAL_IF(mEpollFd < 0, "Could not create epoll instance: %s", strerror(errno));
-
-    epoll_event wakeEvent = createEpollEvent(EPOLLIN, WAKE_EVENT_FD_SEQ);
-    int result = epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mWakeEventFd.get(), &wakeEvent);
-    LOG_ALWAYS_FATAL_IF(result != 0, "Could not add wake event fd to epoll instance: %s",
-                        strerror(errno));
-
-    for (const auto& [seq, request] : mRequests) {
-        epoll_event eventItem = createEpollEvent(request.getEpollEvents(), seq);
-
-        int epollResult = epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, request.fd, &eventItem);
-        if (epollResult < 0) {
-            ALOGE("Error adding epoll events for fd %d while rebuilding epoll set: %s",
-                  request.fd, strerror(errno));
-        }
+    mStaleRegistrations.clear();
+
+    // Allocate the new backend instance and register the WakeEventFd.
+    mBackend = PollBackend::create(backendType, &mStats.waitSyscallCount,
+            &mStats.registrationSyscallCount);
+    if (mBackend == nullptr && backendType != POLL_BACKEND_DEFAULT) {
+        ALOGW("Poll backend %d is unavailable, falling back to the default: %s", backendType,
+              strerror(errno));
+        mBackend = PollBackend::create(POLL_BACKEND_DEFAULT, &mStats.waitSyscallCount,
+                &mStats.registrationSyscallCount);
     }
-#elif HAVE_KQUEUE
-    if (mKqueueFd >= 0) {
-        ALOGD("%p ~ rebuildKqueueLocked - rebuilding kqueue set", this);
-        mKqueueFd.reset();
-    }
-    // Allocate the new kqueue instance and register the WakeEventFd.
-    mKqueueFd.reset(kqueue());
-    LOG_ALWAYS_FATAL_IF(mKqueueFd < 0, "Could not create kqueue instance: %s", strerror(errno));
-    struct kevent wakeEvent = createKqueueEvent(mWakeEventFd.get(), EVFILT_READ, WAKE_EVENT_FD_SEQ);
-    int result = kevent(mKqueueFd.get(), &wakeEvent, 1, nullptr, 0, nullptr);
-    LOG_ALWAYS_FATAL_IF(result < 0, "Could not add wake event fd to kqueue instance: %s",
+    LOG_ALWAYS_FATAL_IF(mBackend == nullptr, "Could not create poll backend: %s",
                         strerror(errno));
-    for (const auto& [seq, request] : mRequests) {
-        Vector<struct kevent> eventItems = createKqueueEvents(request.fd, request.getKqueueFilters(), seq);
-
-        for (const auto& eventItem : eventItems) {
-            int kqueueResult = kevent(mKqueueFd.get(), &eventItem, 1, nullptr, 0, nullptr);
-            if (kqueueResult < 0) {
-                ALOGE("Error adding kqueue events for fd %d while rebuilding kqueue set: %s",
-                      request.fd, strerror(errno));
-            }
+    mStats.pollBackend.store(mBackend->getType(), std::memory_order_relaxed);
+
+    int result = mBackend->addFd(mWakeChannel.getFd(), EVENT_INPUT, WAKE_EVENT_FD_SEQ);
+    LOG_ALWAYS_FATAL_IF(result != 0, "Could not add wake event fd to poll backend: %s",
+                        strerror(result));
+
+    for (const RequestSlot& slot : mRequestSlots) {
+        if (slot.seq == 0) continue;
+        const Request& request = slot.request;
+        int backendResult = mBackend->addFd(request.fd, request.events, slot.seq);
+        if (backendResult != 0) {
+            ALOGE("Error adding poll events for fd %d while rebuilding poll set: %s",
+                  request.fd, strerror(backendResult));
         }
     }
-#endif
 }
 
 void Looper::scheduleEpollRebuildLocked() {
@@ -229,16 +380,61 @@ void Looper::scheduleEpollRebuildLocked() {
     }
 }
 
+void Looper::markStaleRegistrationLocked(SequenceNumber seq) {
+    if (!mBackend->keepsRegistrationsOfClosedFds()) {
+        return;
+    }
+    // Usually the file went away with the fd and took the registration with it, so rather
+    // than rebuild the poll set right away we wait and see whether the registration still
+    // reports events, see pollInner().  Stale registrations that never do are only dropped
+    // by a rebuild, which we hold off until they outnumber the live ones so that its cost
+    // stays proportional to the number of fds that went stale.
+    mStaleRegistrations.emplace(seq, 0);
+    if (mStaleRegistrations.size()
+            > std::max(MIN_STALE_REGISTRATIONS_TO_REBUILD, mRequestCount)) {
+        scheduleEpollRebuildLocked();
+    }
+}
+
+bool Looper::repairStaleRegistrationLocked(int fd, int events, SequenceNumber seq) {
+    // Adding the fd failed because the backend still holds a registration for the file it
+    // refers to, which must be a stale one with the same fd number.  Take it over.
+    bool haveStaleRegistration = false;
+    for (const auto& [staleSeq, reports] : mStaleRegistrations) {
+        if (getRequestSequenceNumberFd(staleSeq) == fd) {
+            haveStaleRegistration = true;
+            break;
+        }
+    }
+    if (!haveStaleRegistration) {
+        return false;
+    }
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ addFd - taking over stale poll events registration of fd %d", this, fd);
+#endif
+    return mBackend->modifyFd(fd, events, events, seq) == 0;
+}
+
+void Looper::flushBackendChangesLocked() {
+    // Changes made by the polling thread are picked up by its next poll, those made by
+    // other threads must reach a poll that may be blocked already.  If we are not polling
+    // yet, the poll will pick them up when it prepares the wait.
+    if (gPollingLooper != this && !mBackend->flushChanges() && mPolling.load()) {
+        wake();
+    }
+}
+
 int Looper::pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outData) {
+    PollingLooperScope pollingLooperScope(this);
     int result = 0;
     for (;;) {
         while (mResponseIndex < mResponses.size()) {
             const Response& response = mResponses.itemAt(mResponseIndex++);
-            int ident = response.request.ident;
+            int ident = response.ident;
             if (ident >= 0) {
-                int fd = response.request.fd;
+                int fd = response.fd;
                 int events = response.events;
-                void* data = response.request.data;
+                void* data = response.data;
 #if DEBUG_POLL_AND_WAKE
                 ALOGD("%p ~ pollOnce - returning signalled identifier %d: "
                         "fd=%d, events=0x%x, data=%p",
@@ -265,49 +461,140 @@ int Looper::pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outDa
     }
 }
 
+int Looper::pollBatch(int timeoutMillis, FdEvent* outEvents, size_t capacity) {
+    if (capacity == 0) {
+        ALOGE("Invalid attempt to poll for a batch of no events.");
+        return POLL_ERROR;
+    }
+
+    capacity = std::min<size_t>(capacity, INT_MAX);
+
+    PollingLooperScope pollingLooperScope(this);
+    int result = 0;
+    for (;;) {
+        // Hand out the identifiers of one poll at once, those that don't fit are left for
+        // the next call.
+        size_t count = 0;
+        while (mResponseIndex < mResponses.size() && count < capacity) {
+            const Response& response = mResponses.itemAt(mResponseIndex++);
+            if (response.ident >= 0) {
+                outEvents[count++] = {.ident = response.ident,
+                                      .fd = response.fd,
+                                      .events = response.events,
+                                      .data = response.data};
+            }
+        }
+        if (count != 0) {
+#if DEBUG_POLL_AND_WAKE
+            ALOGD("%p ~ pollBatch - returning %zu signalled identifiers", this, count);
+#endif
+            return static_cast<int>(count);
+        }
+
+        if (result != 0) {
+#if DEBUG_POLL_AND_WAKE
+            ALOGD("%p ~ pollBatch - returning result %d", this, result);
+#endif
+            return result;
+        }
+
+        result = pollInner(timeoutMillis);
+    }
+}
+
 int Looper::pollInner(int timeoutMillis) {
 #if DEBUG_POLL_AND_WAKE
     ALOGD("%p ~ pollOnce - waiting: timeoutMillis=%d", this, timeoutMillis);
 #endif
 
-    // Adjust the timeout based on when the next message is due.
-    if (timeoutMillis != 0 && mNextMessageUptime != LLONG_MAX) {
+    // Pick up messages posted through the inbox so that they count towards the timeout.
+    if (mInbox.load(std::memory_order_relaxed) != nullptr) {
+        AutoMutex _l(mLock);
+        drainInboxLocked();
+        // Messages left over by the message budget are due already, we won't block anyway.
+        if (mReadyMessages.empty()) {
+            const MessageEnvelope* messageEnvelope = peekMessageLocked();
+            mNextMessageUptime = messageEnvelope != nullptr
+                    ? getMessageWakeupTimeLocked(messageEnvelope->uptime,
+                            systemTime(SYSTEM_TIME_MONOTONIC))
+                    : LLONG_MAX;
+        }
+    }
+
+    // Adjust the timeout based on when the next message is due, to the nanosecond where
+    // the kernel allows it rather than rounding up to the next millisecond.
+    nsecs_t timeoutNanos = timeoutMillis < 0 ? -1 : milliseconds_to_nanoseconds(timeoutMillis);
+    if (timeoutNanos != 0 && mNextMessageUptime != LLONG_MAX) {
         nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
-        int messageTimeoutMillis = toMillisecondTimeoutDelay(now, mNextMessageUptime);
-        if (messageTimeoutMillis >= 0
-                && (timeoutMillis < 0 || messageTimeoutMillis < timeoutMillis)) {
-            timeoutMillis = messageTimeoutMillis;
+        nsecs_t messageTimeoutNanos = std::max<nsecs_t>(mNextMessageUptime - now, 0);
+        if (timeoutNanos < 0 || messageTimeoutNanos < timeoutNanos) {
+            timeoutNanos = messageTimeoutNanos;
         }
 #if DEBUG_POLL_AND_WAKE
-        ALOGD("%p ~ pollOnce - next message in %" PRId64 "ns, adjusted timeout: timeoutMillis=%d",
-                this, mNextMessageUptime - now, timeoutMillis);
+        ALOGD("%p ~ pollOnce - next message in %" PRId64 "ns, adjusted timeout: timeoutNanos=%"
+                PRId64, this, mNextMessageUptime - now, timeoutNanos);
 #endif
     }
 
     // Poll.
     int result = POLL_WAKE;
+    bool growEventBatch = false;
     mResponses.clear();
     mResponseIndex = 0;
 
-    // We are about to idle.
-    mPolling = true;
+    // We are about to idle.  Announce it before checking for a pending wake: either
+    // wake() sees that we are polling and signals the wake event fd, or we see its wake
+    // here and don't block.
+    mPolling.store(true);
+    const bool wokenBeforePoll = mWakePending.exchange(false);
+    if (wokenBeforePoll) {
+        addToCounter<uint64_t>(mStats.wakeCount, 1);
+        timeoutNanos = 0;
+    }
 
-#if HAVE_EPOLL
-    struct epoll_event eventItems[EPOLL_MAX_EVENTS];
-    int eventCount = epoll_wait(mEpollFd.get(), eventItems, EPOLL_MAX_EVENTS, timeoutMillis);
-#elif HAVE_KQUEUE
-    struct kevent eventItems[KQUEUE_MAX_EVENTS];
-    struct timespec timeout = {.tv_sec = timeoutMillis / 1000, .tv_nsec = (timeoutMillis % 1000) * 1000000};
-    int eventCount = kevent(mKqueueFd.get(), nullptr, 0, eventItems, KQUEUE_MAX_EVENTS,
-                            timeoutMillis < 0 ? nullptr : &timeout);
-#endif
+    // Let the backend catch up with registration changes, such as polls to queue again now
+    // that their callbacks had a chance to consume the readiness.  Changes made after this
+    // see that we are polling, see flushBackendChangesLocked().
+    if (mBackend->needsPrepareWait()) {
+        AutoMutex _l(mLock);
+        mBackend->prepareWaitLocked();
+    }
+    const nsecs_t pollStartTime = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    PollEvent* eventItems = mEventItems.data();
+    int eventCount = mBackend->wait(eventItems, mEventItems.size(), timeoutNanos);
 
     // No longer idling.
-    mPolling = false;
+    mPolling.store(false, std::memory_order_relaxed);
+    const nsecs_t pollEndTime = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    addToCounter<uint64_t>(mStats.pollCount, 1);
+    addToCounter(mStats.blockedTime, pollEndTime - pollStartTime);
+    if (eventCount > 0) {
+        addToCounter<uint64_t>(mStats.eventCount, eventCount);
+        maxToCounter<uint64_t>(mStats.maxEventsPerPoll, eventCount);
+        if (static_cast<size_t>(eventCount) == mEventItems.size()) {
+            addToCounter<uint64_t>(mStats.fullEventBatchCount, 1);
+            // There are probably more events pending, fetch more of them next time.
+            if (mEventItems.size() < mOptions.maxEventBatchSize) {
+                growEventBatch = true;
+            }
+        }
+    }
 
     // Acquire lock.
     mLock.lock();
 
+    // Only hold on to the watchdog for this iteration if there is one.
+    sp<LooperWatchdog> watchdog;
+    nsecs_t callbackThreshold = LLONG_MAX;
+    nsecs_t latenessThreshold = LLONG_MAX;
+    if (mWatchdog != nullptr) {
+        watchdog = mWatchdog;
+        callbackThreshold = mWatchdogCallbackThreshold;
+        latenessThreshold = mWatchdogLatenessThreshold;
+    }
+
     // Rebuild epoll set if needed.
     if (mEpollRebuildRequired) {
         mEpollRebuildRequired = false;
@@ -325,12 +612,22 @@ int Looper::pollInner(int timeoutMillis) {
         goto Done;
     }
 
+    // Drop the events that the backend knows to be stale by now.
+    if (eventCount > 0) {
+        eventCount = mBackend->resolveEventsLocked(eventItems, eventCount);
+        if (eventCount == 0) {
+            goto Done;
+        }
+    }
+
     // Check for poll timeout.
     if (eventCount == 0) {
 #if DEBUG_POLL_AND_WAKE
         ALOGD("%p ~ pollOnce - timeout", this);
 #endif
-        result = POLL_TIMEOUT;
+        if (!wokenBeforePoll) {
+            result = POLL_TIMEOUT;
+        }
         goto Done;
     }
 
@@ -340,128 +637,180 @@ int Looper::pollInner(int timeoutMillis) {
 #endif
 
     for (int i = 0; i < eventCount; i++) {
-        const SequenceNumber seq =
-#if HAVE_EPOLL
-            eventItems[i].data.u64;
-            uint32_t epollEvents = eventItems[i].events;
-#elif HAVE_KQUEUE
-            reinterpret_cast<uint64_t>(eventItems[i].udata);
-            int16_t kqueueFilter = eventItems[i].filter;
-            uint16_t flags = eventItems[i].flags;
-#endif
+        const SequenceNumber seq = eventItems[i].seq;
+        const int events = eventItems[i].events;
         if (seq == WAKE_EVENT_FD_SEQ) {
-#if HAVE_EPOLL
-            if (epollEvents & EPOLLIN) {
-#elif HAVE_KQUEUE
-            if (kqueueFilter == EVFILT_READ) {
-#endif
+            if (events & EVENT_INPUT) {
                 awoken();
             } else {
-#if HAVE_EPOLL
-                ALOGW("Ignoring unexpected epoll events 0x%x on wake event fd.", epollEvents);
-#elif HAVE_KQUEUE
-                ALOGW("Ignoring unexpected kqueue events 0x%x on wake event fd.", kqueueFilter);
-#endif
+                ALOGW("Ignoring unexpected events 0x%x on wake event fd.", events);
             }
         } else {
-            const auto& request_it = mRequests.find(seq);
-            if (request_it != mRequests.end()) {
-                const auto& request = request_it->second;
-                int events = 0; 
-#if HAVE_EPOLL
-                if (epollEvents & EPOLLIN) events |= EVENT_INPUT;
-                if (epollEvents & EPOLLOUT) events |= EVENT_OUTPUT;
-                if (epollEvents & EPOLLERR) events |= EVENT_ERROR;
-                if (epollEvents & EPOLLHUP) events |= EVENT_HANGUP;
-                mResponses.push({.seq = seq, .events = events, .request = request});
-#elif HAVE_KQUEUE
-                if (kqueueFilter == EVFILT_READ) events |= EVENT_INPUT;
-                if (kqueueFilter == EVFILT_WRITE) events |= EVENT_OUTPUT;
-                if (flags & EV_ERROR) events |= EVENT_ERROR;
-                if (flags & EV_EOF) events |= EVENT_HANGUP;
-                mResponses.push({.seq = seq, .events = events, .request = request});
-#endif
+            if (const RequestSlot* slot = getRequestSlotLocked(seq)) {
+                pushResponseLocked(seq, events, slot->request);
+            } else if (auto stale = mStaleRegistrations.find(seq);
+                    stale != mStaleRegistrations.end()) {
+                // An event of a registration whose fd went away may have been on its way
+                // already, a second one means that the registration is still there.  It
+                // cannot be removed through its fd anymore, so start over.
+                if (++stale->second > 1) {
+                    scheduleEpollRebuildLocked();
+                }
             } else {
-#if HAVE_EPOLL
-                ALOGW("Ignoring unexpected epoll events 0x%x for sequence number %" PRIu64
+                ALOGW("Ignoring unexpected events 0x%x for sequence number %" PRIu64
                       " that is no longer registered.",
-                      epollEvents, seq);
-#elif HAVE_KQUEUE
-                ALOGW("Ignoring unexpected kqueue events %" PRIi16 " for sequence number %" PRIu64
-                      " and ident=%" PRIuPTR " that is no longer registered.",
-                      kqueueFilter, seq, eventItems[i].ident);
-#endif
+                      events, seq);
             }
         }
     }
 Done: ;
 
+    drainInboxLocked();
+
     // Invoke pending message callbacks.
     mNextMessageUptime = LLONG_MAX;
-    while (mMessageEnvelopes.size() != 0) {
-        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
-        const MessageEnvelope& messageEnvelope = mMessageEnvelopes.itemAt(0);
-        if (messageEnvelope.uptime <= now) {
-            // Remove the envelope from the list.
-            // We keep a strong reference to the handler until the call to handleMessage
-            // finishes.  Then we drop it so that the handler can be deleted *before*
-            // we reacquire our lock.
-            { // obtain handler
-                sp<MessageHandler> handler = messageEnvelope.handler;
-                Message message = messageEnvelope.message;
-                mMessageEnvelopes.removeAt(0);
-                mSendingMessage = true;
-                mLock.unlock();
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    size_t messagesHandled = 0;
+    while (const MessageEnvelope* messageEnvelope = peekReadyMessageLocked(now)) {
+        if (isOverMessageBudget(messagesHandled, now - pollEndTime)) {
+            // Leave the rest for the next poll, which won't block, and see to the fds first.
+            mNextMessageUptime = now;
+            break;
+        }
+        const nsecs_t lateness = now - messageEnvelope->uptime;
+        addToCounter<uint64_t>(mStats.messageCount, 1);
+        addToCounter(mStats.totalMessageLateness, lateness);
+        maxToCounter(mStats.maxMessageLateness, lateness);
+
+        // Remove the envelope from the list.
+        // We keep a strong reference to the handler until the call to handleMessage
+        // finishes.  Then we drop it so that the handler can be deleted *before*
+        // we reacquire our lock.
+        { // obtain handler
+            sp<MessageHandler> handler;
+            Message message;
+            popMessageLocked(now, &handler, &message);
+            mSendingMessage = true;
+            mLock.unlock();
 
 #if DEBUG_POLL_AND_WAKE || DEBUG_CALLBACKS
-                ALOGD("%p ~ pollOnce - sending message: handler=%p, what=%d",
-                        this, handler.get(), message.what);
+            ALOGD("%p ~ pollOnce - sending message: handler=%p, what=%d",
+                    this, handler.get(), message.what);
 #endif
-                handler->handleMessage(message);
-            } // release handler
+            if (lateness > latenessThreshold) {
+                watchdog->onLateMessage(handler, message.what, lateness);
+            }
+            const nsecs_t messageStartTime = now;
+            handler->handleMessage(message);
 
-            mLock.lock();
-            mSendingMessage = false;
-            result = POLL_CALLBACK;
-        } else {
-            // The last message left at the head of the queue determines the next wakeup time.
-            mNextMessageUptime = messageEnvelope.uptime;
-            break;
+            // The end of this message is as good a time as any to check the next one.
+            now = recordCallbackDuration(messageStartTime);
+            if (now - messageStartTime > callbackThreshold) {
+                watchdog->onSlowMessage(handler, message.what, now - messageStartTime);
+            }
+        } // release handler
+
+        mLock.lock();
+        mSendingMessage = false;
+        messagesHandled += 1;
+        result = POLL_CALLBACK;
+    }
+    if (mNextMessageUptime == LLONG_MAX) {
+        // The first message left in the queue determines the next wakeup time.
+        if (const MessageEnvelope* messageEnvelope = peekMessageLocked()) {
+            mNextMessageUptime = getMessageWakeupTimeLocked(messageEnvelope->uptime, now);
         }
     }
 
     // Release lock.
     mLock.unlock();
 
+    // The events have all been consumed so the buffer may be reallocated now.
+    if (growEventBatch) {
+        mEventItems.resize(std::min(mEventItems.size() * 2, mOptions.maxEventBatchSize));
+        mStats.eventBatchSize.store(mEventItems.size(), std::memory_order_relaxed);
+    }
+
     // Invoke all response callbacks.
     for (size_t i = 0; i < mResponses.size(); i++) {
-        Response& response = mResponses.editItemAt(i);
-        if (response.request.ident == POLL_CALLBACK) {
-            int fd = response.request.fd;
+        const Response& response = mResponses.itemAt(i);
+        if (response.ident == POLL_CALLBACK) {
+            int fd = response.fd;
             int events = response.events;
-            void* data = response.request.data;
+            void* data = response.data;
 #if DEBUG_POLL_AND_WAKE || DEBUG_CALLBACKS
             ALOGD("%p ~ pollOnce - invoking fd event callback %p: fd=%d, events=0x%x, data=%p",
-                    this, response.request.callback.get(), fd, events, data);
+                    this, response.callback, fd, events, data);
 #endif
             // Invoke the callback.  Note that the file descriptor may be closed by
             // the callback (and potentially even reused) before the function returns so
             // we need to be a little careful when removing the file descriptor afterwards.
-            int callbackResult = response.request.callback->handleEvent(fd, events, data);
+            const nsecs_t callbackStartTime = now;
+            int callbackResult = response.callback->handleEvent(fd, events, data);
+            now = recordCallbackDuration(callbackStartTime);
+            if (now - callbackStartTime > callbackThreshold) {
+                watchdog->onSlowCallback(fd, events, now - callbackStartTime);
+            }
             if (callbackResult == 0) {
                 AutoMutex _l(mLock);
                 removeSequenceNumberLocked(response.seq);
             }
-
-            // Clear the callback reference in the response structure promptly because we
-            // will not clear the response vector itself until the next poll.
-            response.request.callback.clear();
             result = POLL_CALLBACK;
         }
     }
+
+    // Now that no response refers to them any more, drop the callbacks of the requests
+    // that were removed in the meantime, outside of the lock.
+    if (mDeferCallbackReleases) {
+        std::vector<sp<LooperCallback>> retiredCallbacks;
+        mLock.lock();
+        mDeferCallbackReleases = false;
+        retiredCallbacks.swap(mRetiredCallbacks);
+        mLock.unlock();
+    }
+
+    addToCounter(mStats.dispatchTime, now - pollEndTime);
     return result;
 }
 
+bool Looper::isOverMessageBudget(size_t messagesHandled, nsecs_t elapsed) const {
+    if (messagesHandled == 0) {
+        return false;
+    }
+    return (mOptions.maxMessagesPerPoll != 0 && messagesHandled >= mOptions.maxMessagesPerPoll)
+            || (mOptions.maxMessageTimePerPoll != 0 && elapsed >= mOptions.maxMessageTimePerPoll);
+}
+
+nsecs_t Looper::recordCallbackDuration(nsecs_t startTime) {
+    const nsecs_t endTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    const nsecs_t duration = endTime - startTime;
+    size_t bucket = 0;
+    if (duration > 1) {
+        bucket = std::min<size_t>(63 - __builtin_clzll(static_cast<uint64_t>(duration)),
+                CALLBACK_DURATION_BUCKETS - 1);
+    }
+    addToCounter<uint64_t>(mStats.callbackDurationHistogram[bucket], 1);
+    return endTime;
+}
+
+void Looper::pushResponseLocked(SequenceNumber seq, int events, const Request& request) {
+    // The response borrows the callback instead of taking a strong reference to it, so
+    // that dispatching an event does not cost an atomic increment and decrement.
+    if (request.callback != nullptr) {
+        mDeferCallbackReleases = true;
+    }
+    mResponses.push({.seq = seq, .events = events, .ident = request.ident, .fd = request.fd,
+            .data = request.data, .callback = request.callback.get()});
+}
+
+void Looper::releaseCallbackLocked(sp<LooperCallback>&& callback) {
+    if (mDeferCallbackReleases && callback != nullptr) {
+        mRetiredCallbacks.push_back(std::move(callback));
+    } else {
+        callback.clear();
+    }
+}
+
 int Looper::pollAll(int timeoutMillis, int* outFd, int* outEvents, void** outData) {
     if (timeoutMillis <= 0) {
         int result;
@@ -493,14 +842,13 @@ void Looper::wake() {
     ALOGD("%p ~ wake", this);
 #endif
 
-    uint64_t inc = 1;
-    ssize_t nWrite = TEMP_FAILURE_RETRY(write(mWakeEventFd.get(), &inc, sizeof(uint64_t)));
-    if (nWrite != sizeof(uint64_t)) {
-        if (errno != EAGAIN) {
-            LOG_ALWAYS_FATAL("Could not write wake signal to fd %d (returned %zd): %s",
-                             mWakeEventFd.get(), nWrite, strerror(errno));
-        }
+    // Only the first wake since the looper last noticed one needs to signal, and only
+    // if the looper is blocked: otherwise it checks for the pending wake before polling.
+    if (mWakePending.exchange(true) || !mPolling.load()) {
+        return;
     }
+
+    mWakeChannel.signal();
 }
 
 void Looper::awoken() {
@@ -508,8 +856,10 @@ void Looper::awoken() {
     ALOGD("%p ~ awoken", this);
 #endif
 
-    uint64_t counter;
-    TEMP_FAILURE_RETRY(read(mWakeEventFd.get(), &counter, sizeof(uint64_t)));
+    // Clear the pending wake first so that a wake racing with the drain signals again.
+    mWakePending.store(false);
+    mWakeChannel.drain();
+    addToCounter<uint64_t>(mStats.wakeCount, 1);
 }
 
 int Looper::addFd(int fd, int ident, int events, Looper_callbackFunc callback, void* data) {
@@ -526,265 +876,369 @@ int Looper::addFd(int fd, int ident, int events, const sp<LooperCallback>& callb
             events, callback.get(), data);
 #endif
 
+    if (!checkFdRegistration(fd, &ident, callback)) {
+        return -1;
+    }
+
+    { // acquire lock
+        AutoMutex _l(mLock);
+        if (static_cast<size_t>(fd) >= mRequestSlots.size()) {
+            mRequestSlots.resize(fd + 1);
+        }
+        PollChange change = prepareFdChangeLocked(fd, events);
+        change.result = change.op == PollChange::ADD
+                ? mBackend->addFd(fd, events, change.seq)
+                : mBackend->modifyFd(fd, change.oldEvents, events, change.seq);
+        if (!commitFdChangeLocked(change, {fd, ident, events, callback, data})) {
+            return -1;
+        }
+        flushBackendChangesLocked();
+    } // release lock
+    return 1;
+}
+
+size_t Looper::addFds(const FdRegistration* registrations, size_t count) {
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ addFds - count=%zu", this, count);
+#endif
+
+    std::vector<Request> requests;
+    requests.reserve(count);
+    int maxFd = -1;
+    for (size_t i = 0; i < count; i++) {
+        const FdRegistration& registration = registrations[i];
+        int ident = registration.ident;
+        if (checkFdRegistration(registration.fd, &ident, registration.callback)) {
+            requests.push_back({registration.fd, ident, registration.events,
+                                registration.callback, registration.data});
+            maxFd = std::max(maxFd, registration.fd);
+        }
+    }
+    if (requests.empty()) {
+        return 0;
+    }
+
+    AutoMutex _l(mLock);
+    if (static_cast<size_t>(maxFd) >= mRequestSlots.size()) {
+        mRequestSlots.resize(maxFd + 1);
+    }
+
+    // One change per fd, a later registration of the same fd replaces an earlier one as if
+    // they had been added one after the other.
+    std::vector<PollChange> changes;
+    std::vector<size_t> changeRequests;  // the index of the request of each change
+    std::unordered_map<int, size_t> changesByFd;
+    changes.reserve(requests.size());
+    changeRequests.reserve(requests.size());
+    changesByFd.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        const Request& request = requests[i];
+        auto [it, inserted] = changesByFd.emplace(request.fd, changes.size());
+        if (!inserted) {
+            changes[it->second].events = request.events;
+            changeRequests[it->second] = i;
+            continue;
+        }
+        changes.push_back(prepareFdChangeLocked(request.fd, request.events));
+        changeRequests.push_back(i);
+    }
+
+    mBackend->applyChanges(changes.data(), changes.size());
+
+    size_t addedCount = 0;
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (commitFdChangeLocked(changes[i], std::move(requests[changeRequests[i]]))) {
+            addedCount++;
+        }
+    }
+    flushBackendChangesLocked();
+    return addedCount;
+}
+
+bool Looper::checkFdRegistration(int fd, int* ident, const sp<LooperCallback>& callback) const {
     if (!callback.get()) {
         if (! mAllowNonCallbacks) {
             ALOGE("Invalid attempt to set NULL callback but not allowed for this looper.");
-            return -1;
+            return false;
         }
 
-        if (ident < 0) {
+        if (*ident < 0) {
             ALOGE("Invalid attempt to set NULL callback with ident < 0.");
-            return -1;
+            return false;
         }
     } else {
-        ident = POLL_CALLBACK;
+        *ident = POLL_CALLBACK;
     }
 
-    { // acquire lock
-        AutoMutex _l(mLock);
-        // There is a sequence number reserved for the WakeEventFd.
-        if (mNextRequestSeq == WAKE_EVENT_FD_SEQ) mNextRequestSeq++;
-        const SequenceNumber seq = mNextRequestSeq++;
-
-        Request request;
-        request.fd = fd;
-        request.ident = ident;
-        request.events = events;
-        request.callback = callback;
-        request.data = data;
-#if HAVE_EPOLL
-        epoll_event eventItem = createEpollEvent(request.getEpollEvents(), seq);
-        auto seq_it = mSequenceNumberByFd.find(fd);
-        if (seq_it == mSequenceNumberByFd.end()) {
-            int epollResult = epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &eventItem);
-            if (epollResult < 0) {
-                ALOGE("Error adding epoll events for fd %d: %s", fd, strerror(errno));
-                return -1;
-            }
-            mRequests.emplace(seq, request);
-            mSequenceNumberByFd.emplace(fd, seq);
-        } else {
-            int epollResult = epoll_ctl(mEpollFd.get(), EPOLL_CTL_MOD, fd, &eventItem);
-            if (epollResult < 0) {
-                if (errno == ENOENT) {
-                    // Tolerate ENOENT because it means that an older file descriptor was
-                    // closed before its callback was unregistered and meanwhile a new
-                    // file descriptor with the same number has been created and is now
-                    // being registered for the first time.  This error may occur naturally
-                    // when a callback has the side-effect of closing the file descriptor
-                    // before returning and unregistering itself.  Callback sequence number
-                    // checks further ensure that the race is benign.
-                    //
-                    // Unfortunately due to kernel limitations we need to rebuild the epoll
-                    // set from scratch because it may contain an old file handle that we are
-                    // now unable to remove since its file descriptor is no longer valid.
-                    // No such problem would have occurred if we were using the poll system
-                    // call instead, but that approach carries other disadvantages.
-#if DEBUG_CALLBACKS
-                    ALOGD("%p ~ addFd - EPOLL_CTL_MOD failed due to file descriptor "
-                            "being recycled, falling back on EPOLL_CTL_ADD: %s",
-                            this, strerror(errno));
-#endif
-                    epollResult = epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &eventItem);
-                    if (epollResult < 0) {
-                        ALOGE("Error modifying or adding epoll events for fd %d: %s",
-                                fd, strerror(errno));
-                        return -1;
-                    }
-                    scheduleEpollRebuildLocked();
-                } else {
-                    ALOGE("Error modifying epoll events for fd %d: %s", fd, strerror(errno));
-                    return -1;
-                }
-            }
-            const SequenceNumber oldSeq = seq_it->second;
-            mRequests.erase(oldSeq);
-            mRequests.emplace(seq, request);
-            seq_it->second = seq;
+    if (fd < 0) {
+        ALOGE("Invalid attempt to add negative fd %d.", fd);
+        return false;
+    }
+    return true;
+}
+
+PollChange Looper::prepareFdChangeLocked(int fd, int events) {
+    RequestSlot& slot = mRequestSlots[fd];
+    // Each registration gets a new generation, so that events still queued for an
+    // earlier registration of the same fd are recognized as stale.
+    if (++slot.generation == 0) slot.generation = 1;
+    return {.op = slot.seq == 0 ? PollChange::ADD : PollChange::MODIFY,
+            .fd = fd,
+            .oldEvents = slot.request.events,
+            .events = events,
+            .seq = makeRequestSequenceNumber(fd, slot.generation),
+            .result = 0};
+}
+
+bool Looper::commitFdChangeLocked(const PollChange& change, Request&& request) {
+    RequestSlot& slot = mRequestSlots[change.fd];
+    const int fd = change.fd;
+    int backendResult = change.result;
+    if (change.op == PollChange::ADD) {
+        if (backendResult == EEXIST
+                && repairStaleRegistrationLocked(fd, change.events, change.seq)) {
+            backendResult = 0;
         }
-#elif HAVE_KQUEUE
-        Vector<struct kevent> eventItems = createKqueueEvents(fd, request.getKqueueFilters(), seq);
-        auto seq_it = mSequenceNumberByFd.find(fd);
-        if (seq_it == mSequenceNumberByFd.end()) {
-            int kqueueResult = kevent(mKqueueFd.get(), eventItems.array(), eventItems.size(),
-                                      nullptr, 0, nullptr);
-            if (kqueueResult < 0) {
-                ALOGE("Error adding kqueue events for fd %d: %s", fd, strerror(errno));
-                return -1;
+        if (backendResult != 0) {
+            ALOGE("Error adding poll events for fd %d: %s", fd, strerror(backendResult));
+            return false;
+        }
+    } else if (backendResult != 0) {
+        if (backendResult == ENOENT) {
+            // Tolerate ENOENT because it means that an older file descriptor was
+            // closed before its callback was unregistered and meanwhile a new
+            // file descriptor with the same number has been created and is now
+            // being registered for the first time.  This error may occur naturally
+            // when a callback has the side-effect of closing the file descriptor
+            // before returning and unregistering itself.  Callback sequence number
+            // checks further ensure that the race is benign.
+            //
+            // Unfortunately due to kernel limitations the epoll set may still contain
+            // the old file handle, which we are now unable to remove since its file
+            // descriptor is no longer valid.  We keep track of it in case it turns
+            // out to be there, see markStaleRegistrationLocked().
+#if DEBUG_CALLBACKS
+            ALOGD("%p ~ addFd - modifying poll events failed due to file descriptor "
+                    "being recycled, falling back on adding them: %s",
+                    this, strerror(backendResult));
+#endif
+            backendResult = mBackend->addFd(fd, change.events, change.seq);
+            if (backendResult != 0) {
+                ALOGE("Error modifying or adding poll events for fd %d: %s",
+                        fd, strerror(backendResult));
+                return false;
             }
-            mRequests.emplace(seq, request);
-            mSequenceNumberByFd.emplace(fd, seq);
-            ALOGD("%p ~ addFd - added fd %d with seq %" PRIu64, this, fd, seq);
+            markStaleRegistrationLocked(slot.seq);
         } else {
-            int kqueueResult = kevent(mKqueueFd.get(), eventItems.array(), eventItems.size(),
-                                      nullptr, 0, nullptr);
-            if (kqueueResult < 0) {
-                if (errno == ENOENT) {
-                    // Tolerate ENOENT because it means that an older file descriptor was
-                    // closed before its callback was unregistered and meanwhile a new
-                    // file descriptor with the same number has been created and is now
-                    // being registered for the first time.  This error may occur naturally
-                    // when a callback has the side-effect of closing the file descriptor
-                    // before returning and unregistering itself.  Callback sequence number
-                    // checks further ensure that the correct callback is unregistered.
-                    // This is safe because we hold the lock while making these changes.
-                    // If a new callback is registered for the same FD, it will get a new
-                    // sequence number and won't interfere with the old one.
-               }
-                ALOGE("Error modifying kqueue events for fd %d: %s", fd, strerror(errno));
-                return -1;
-            }
-            const SequenceNumber oldSeq = seq_it->second;
-            mRequests.erase(oldSeq);
-            mRequests.emplace(seq, request);
-            seq_it->second = seq;
-            ALOGD("%p ~ addFd - modified fd %d with seq %" PRIu64, this, fd, seq);
+            ALOGE("Error modifying poll events for fd %d: %s", fd, strerror(backendResult));
+            return false;
         }
-#endif
-    } // release lock
-    return 1;
+    }
+    if (slot.seq == 0) {
+        mRequestCount++;
+    }
+    slot.seq = change.seq;
+    releaseCallbackLocked(std::move(slot.request.callback));
+    slot.request = std::move(request);
+    return true;
 }
 
 bool Looper::getFdStateDebug(int fd, int* ident, int* events, sp<LooperCallback>* cb, void** data) {
     AutoMutex _l(mLock);
-    if (auto seqNumIt = mSequenceNumberByFd.find(fd); seqNumIt != mSequenceNumberByFd.cend()) {
-        if (auto reqIt = mRequests.find(seqNumIt->second); reqIt != mRequests.cend()) {
-            const Request& request = reqIt->second;
-            if (ident) *ident = request.ident;
-            if (events) *events = request.events;
-            if (cb) *cb = request.callback;
-            if (data) *data = request.data;
-            return true;
-        }
+    if (const RequestSlot* slot = getRequestSlotByFdLocked(fd)) {
+        const Request& request = slot->request;
+        if (ident) *ident = request.ident;
+        if (events) *events = request.events;
+        if (cb) *cb = request.callback;
+        if (data) *data = request.data;
+        return true;
     }
     return false;
 }
 
 int Looper::removeFd(int fd) {
     AutoMutex _l(mLock);
-    const auto& it = mSequenceNumberByFd.find(fd);
-    if (it == mSequenceNumberByFd.end()) {
+    const RequestSlot* slot = getRequestSlotByFdLocked(fd);
+    if (slot == nullptr) {
         return 0;
     }
-    return removeSequenceNumberLocked(it->second);
+    return removeSequenceNumberLocked(slot->seq);
 }
 
 int Looper::repoll(int fd) {
     AutoMutex _l(mLock);
-    const auto& it = mSequenceNumberByFd.find(fd);
-    if (it == mSequenceNumberByFd.end()) {
-        return 0;
-    }
-
-    const auto& request_it = mRequests.find(it->second);
-    if (request_it == mRequests.end()) {
+    const RequestSlot* slot = getRequestSlotByFdLocked(fd);
+    if (slot == nullptr) {
         return 0;
     }
-    const auto& [seq, request] = *request_it;
+    const SequenceNumber seq = slot->seq;
+    const Request& request = slot->request;
 
     LOG_ALWAYS_FATAL_IF(
             fd != request.fd,
             "Looper has inconsistent data structure. When looking up FD %d found FD %d.", fd,
-            request_it->second.fd);
+            request.fd);
 
-#if HAVE_EPOLL
-    epoll_event eventItem = createEpollEvent(request.getEpollEvents(), seq);
-    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_MOD, fd, &eventItem) == -1) return 0;
-#elif HAVE_KQUEUE
-    Vector<struct kevent> eventItems = createKqueueEvents(fd, request.getKqueueFilters(), seq);
-    if (kevent(mKqueueFd.get(), eventItems.array(), eventItems.size(),
-               nullptr, 0, nullptr) == -1) {
-        return 0;
-    }
-#endif
+    if (mBackend->repollFd(fd, request.events, seq) != 0) return 0;
+    flushBackendChangesLocked();
 
     return 1;  // success
 }
 
+Looper::RequestSlot* Looper::getRequestSlotLocked(SequenceNumber seq) {
+    const size_t fd = static_cast<uint32_t>(getRequestSequenceNumberFd(seq));
+    if (fd < mRequestSlots.size() && mRequestSlots[fd].seq == seq) {
+        return &mRequestSlots[fd];
+    }
+    return nullptr;
+}
+
+Looper::RequestSlot* Looper::getRequestSlotByFdLocked(int fd) {
+    if (fd >= 0 && static_cast<size_t>(fd) < mRequestSlots.size()
+            && mRequestSlots[fd].seq != 0) {
+        return &mRequestSlots[fd];
+    }
+    return nullptr;
+}
+
 int Looper::removeSequenceNumberLocked(SequenceNumber seq) {
 #if DEBUG_CALLBACKS
     ALOGD("%p ~ removeFd - seq=%" PRIu64, this, seq);
 #endif
 
-    const auto& request_it = mRequests.find(seq);
-    if (request_it == mRequests.end()) {
+    RequestSlot* slot = getRequestSlotLocked(seq);
+    if (slot == nullptr) {
+        return 0;
+    }
+    PollChange change = detachRequestLocked(*slot);
+    change.result = mBackend->removeFd(change.fd, change.events, change.seq);
+    if (!finishFdRemovalLocked(change)) {
+        return -1;
+    }
+    flushBackendChangesLocked();
+    return 1;
+}
+
+size_t Looper::removeFds(const int* fds, size_t count) {
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ removeFds - count=%zu", this, count);
+#endif
+
+    AutoMutex _l(mLock);
+    std::vector<PollChange> changes;
+    changes.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        // An fd that is listed twice is no longer registered the second time.
+        if (RequestSlot* slot = getRequestSlotByFdLocked(fds[i])) {
+            changes.push_back(detachRequestLocked(*slot));
+        }
+    }
+    if (changes.empty()) {
         return 0;
     }
-    const int fd = request_it->second.fd;
 
-    // Always remove the FD from the request map even if an error occurs while
+    mBackend->applyChanges(changes.data(), changes.size());
+
+    size_t removedCount = 0;
+    for (const PollChange& change : changes) {
+        if (finishFdRemovalLocked(change)) {
+            removedCount++;
+        }
+    }
+    flushBackendChangesLocked();
+    return removedCount;
+}
+
+PollChange Looper::detachRequestLocked(RequestSlot& slot) {
+    // Always remove the FD from the request table even if an error occurs while
     // updating the epoll set so that we avoid accidentally leaking callbacks.
-    mRequests.erase(request_it);
-    mSequenceNumberByFd.erase(fd);
+    const PollChange change = {.op = PollChange::REMOVE,
+                               .fd = slot.request.fd,
+                               .oldEvents = slot.request.events,
+                               .events = slot.request.events,
+                               .seq = slot.seq,
+                               .result = 0};
+    slot.seq = 0;
+    mRequestCount--;
+    releaseCallbackLocked(std::move(slot.request.callback));
+    return change;
+}
 
-#if HAVE_EPOLL
-    int epollResult = epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
-    if (epollResult < 0) {
-#elif HAVE_KQUEUE
-    Vector<struct kevent> eventItems = createKqueueEventsForDelete(mKqueueFd.get(), seq);
-    int kqueueResult = kevent(mKqueueFd.get(), eventItems.array(), eventItems.size(), nullptr, 0, nullptr);
-    if (kqueueResult < 0) {
-#endif
-        if (errno == EBADF || errno == ENOENT) {
+bool Looper::finishFdRemovalLocked(const PollChange& change) {
+    const int backendResult = change.result;
+    if (backendResult != 0) {
+        if (backendResult == EBADF || backendResult == ENOENT) {
             // Tolerate EBADF or ENOENT because it means that the file descriptor was closed
             // before its callback was unregistered. This error may occur naturally when a
             // callback has the side-effect of closing the file descriptor before returning and
             // unregistering itself.
             //
-            // Unfortunately due to kernel limitations we need to rebuild the epoll
-            // set from scratch because it may contain an old file handle that we are
-            // now unable to remove since its file descriptor is no longer valid.
-            // No such problem would have occurred if we were using the poll system
-            // call instead, but that approach carries other disadvantages.
+            // Unfortunately due to kernel limitations the epoll set may still contain
+            // the old file handle, which we are now unable to remove since its file
+            // descriptor is no longer valid.  We keep track of it in case it turns out
+            // to be there, see markStaleRegistrationLocked().
 #if DEBUG_CALLBACKS
-            ALOGD("%p ~ removeFd - EPOLL_CTL_DEL failed due to file descriptor "
+            ALOGD("%p ~ removeFd - removing poll events failed due to file descriptor "
                   "being closed: %s",
-                  this, strerror(errno));
+                  this, strerror(backendResult));
 #endif
-            scheduleEpollRebuildLocked();
+            markStaleRegistrationLocked(change.seq);
         } else {
             // Some other error occurred.  This is really weird because it means
             // our list of callbacks got out of sync with the epoll set somehow.
             // We defensively rebuild the epoll set to avoid getting spurious
             // notifications with nowhere to go.
-            ALOGE("Error removing epoll events for fd %d: %s", fd, strerror(errno));
+            ALOGE("Error removing poll events for fd %d: %s", change.fd,
+                    strerror(backendResult));
             scheduleEpollRebuildLocked();
-            return -1;
+            return false;
         }
-        ALOGD("%p ~ removeFd - removed fd %d with seq %" PRIu64, this, fd, seq);
+        ALOGD("%p ~ removeFd - removed fd %d with seq %" PRIu64, this, change.fd, change.seq);
     }
-    return 1;
+    return true;
 }
 
-void Looper::sendMessage(const sp<MessageHandler>& handler, const Message& message) {
+void Looper::sendMessage(const sp<MessageHandler>& handler, const Message& message,
+        int priority) {
     nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
-    sendMessageAtTime(now, handler, message);
+    sendMessageAtTime(now, handler, message, priority);
 }
 
 void Looper::sendMessageDelayed(nsecs_t uptimeDelay, const sp<MessageHandler>& handler,
-        const Message& message) {
+        const Message& message, int priority) {
     nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
-    sendMessageAtTime(now + uptimeDelay, handler, message);
+    sendMessageAtTime(now + uptimeDelay, handler, message, priority);
 }
 
 void Looper::sendMessageAtTime(nsecs_t uptime, const sp<MessageHandler>& handler,
-        const Message& message) {
+        const Message& message, int priority) {
 #if DEBUG_CALLBACKS
-    ALOGD("%p ~ sendMessageAtTime - uptime=%" PRId64 ", handler=%p, what=%d",
-            this, uptime, handler.get(), message.what);
+    ALOGD("%p ~ sendMessageAtTime - uptime=%" PRId64 ", handler=%p, what=%d, priority=%d",
+            this, uptime, handler.get(), message.what, priority);
 #endif
+    checkMessagePriority(priority);
+
+    if (mOptions.lockFreeMessagePosting) {
+        InboxMessage* inboxMessage = new InboxMessage{uptime, priority, handler, message, nullptr};
+        InboxMessage* head = mInbox.load(std::memory_order_relaxed);
+        do {
+            inboxMessage->next = head;
+        } while (!mInbox.compare_exchange_weak(head, inboxMessage,
+                std::memory_order_release, std::memory_order_relaxed));
+
+        // Only the first message of a batch needs to wake the poll loop, it will pick up
+        // everything that was pushed before it gets around to draining the inbox.
+        if (head == nullptr) {
+            wake();
+        }
+        return;
+    }
 
-    size_t i = 0;
+    bool isHead;
     { // acquire lock
         AutoMutex _l(mLock);
 
-        size_t messageCount = mMessageEnvelopes.size();
-        while (i < messageCount && uptime >= mMessageEnvelopes.itemAt(i).uptime) {
-            i += 1;
-        }
-
-        MessageEnvelope messageEnvelope(uptime, handler, message);
-        mMessageEnvelopes.insertAt(messageEnvelope, i, 1);
+        isHead = enqueueMessageLocked(uptime, priority, handler, message);
 
         // Optimization: If the Looper is currently sending a message, then we can skip
         // the call to wake() because the next thing the Looper will do after processing
@@ -796,11 +1250,332 @@ void Looper::sendMessageAtTime(nsecs_t uptime, const sp<MessageHandler>& handler
     } // release lock
 
     // Wake the poll loop only when we enqueue a new message at the head.
-    if (i == 0) {
+    if (isHead) {
         wake();
     }
 }
 
+void Looper::sendMessagesAtTime(const MessageAtTime* messages, size_t count) {
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ sendMessagesAtTime - count=%zu", this, count);
+#endif
+
+    if (count == 0) {
+        return;
+    }
+
+    if (mOptions.lockFreeMessagePosting) {
+        // Chain the batch up newest first, then splice it onto the inbox with one CAS.
+        InboxMessage* first = nullptr;
+        InboxMessage* last = nullptr;
+        for (size_t i = 0; i < count; i++) {
+            const MessageAtTime& m = messages[i];
+            checkMessagePriority(m.priority);
+            first = new InboxMessage{m.uptime, m.priority, m.handler, m.message, first};
+            if (last == nullptr) {
+                last = first;
+            }
+        }
+        InboxMessage* head = mInbox.load(std::memory_order_relaxed);
+        do {
+            last->next = head;
+        } while (!mInbox.compare_exchange_weak(head, first,
+                std::memory_order_release, std::memory_order_relaxed));
+
+        if (head == nullptr) {
+            wake();
+        }
+        return;
+    }
+
+    bool isHead = false;
+    { // acquire lock
+        AutoMutex _l(mLock);
+
+        for (size_t i = 0; i < count; i++) {
+            const MessageAtTime& m = messages[i];
+            checkMessagePriority(m.priority);
+            // The head changed if any message of the batch became the head when enqueued.
+            isHead |= enqueueMessageLocked(m.uptime, m.priority, m.handler, m.message);
+        }
+
+        if (mSendingMessage) {
+            return;
+        }
+    } // release lock
+
+    if (isHead) {
+        wake();
+    }
+}
+
+bool Looper::enqueueMessageLocked(nsecs_t uptime, int priority,
+        const sp<MessageHandler>& handler, const Message& message) {
+    const uint32_t slot = acquireMessageSlotLocked();
+    MessageEnvelope* envelopes = mMessageEnvelopes.data();
+    MessageEnvelope& envelope = envelopes[slot];
+    const uint64_t seq = mNextMessageSeq++;
+    envelope.uptime = uptime;
+    envelope.seq = seq;
+    envelope.priority = priority;
+    if (priority != MESSAGE_PRIORITY_NORMAL) {
+        mPrioritizedMessageCount += 1;
+    }
+    envelope.handler = handler;
+    envelope.message = message;
+
+    // Link the envelope at the head of its handler and (handler, what) lists.
+    envelope.prevByHandler = NO_MESSAGE_SLOT;
+    auto [handlerIt, newHandler] = mMessagesByHandler.try_emplace(handler.get(), slot);
+    if (newHandler) {
+        envelope.nextByHandler = NO_MESSAGE_SLOT;
+    } else {
+        envelope.nextByHandler = handlerIt->second;
+        envelopes[handlerIt->second].prevByHandler = slot;
+        handlerIt->second = slot;
+    }
+    envelope.prevByWhat = NO_MESSAGE_SLOT;
+    auto [whatIt, newWhat] = mMessagesByWhat.try_emplace({handler.get(), message.what}, slot);
+    if (newWhat) {
+        envelope.nextByWhat = NO_MESSAGE_SLOT;
+    } else {
+        envelope.nextByWhat = whatIt->second;
+        envelopes[whatIt->second].prevByWhat = slot;
+        whatIt->second = slot;
+    }
+
+    return pushMessageHeapLocked(uptime, seq, slot);
+}
+
+uint32_t Looper::acquireMessageSlotLocked() {
+    // Discard tombstones at the top first so that the top afterwards is the earliest
+    // live message, which tells us whether the new message becomes the head.
+    peekMessageLocked();
+
+    uint32_t slot;
+    if (!mFreeMessageSlots.empty()) {
+        slot = mFreeMessageSlots.back();
+        mFreeMessageSlots.pop_back();
+    } else {
+        slot = mMessageEnvelopes.size();
+        mMessageEnvelopes.emplace_back();
+    }
+    mStats.messageQueueDepth.store(mMessageEnvelopes.size() - mFreeMessageSlots.size(),
+            std::memory_order_relaxed);
+    return slot;
+}
+
+bool Looper::pushMessageHeapLocked(nsecs_t uptime, uint64_t seq, uint32_t slot) {
+    mMessageHeap.push_back({.uptime = uptime, .seq = seq, .slot = slot});
+    std::push_heap(mMessageHeap.begin(), mMessageHeap.end(), isMessageDueAfter<MessageHeapEntry>);
+    return mMessageHeap.front().seq == seq;
+}
+
+const Looper::MessageEnvelope* Looper::peekMessageLocked() {
+    while (!mMessageHeap.empty()) {
+        const MessageHeapEntry& top = mMessageHeap.front();
+        const MessageEnvelope& envelope = mMessageEnvelopes[top.slot];
+        if (envelope.seq == top.seq) {
+            return &envelope;
+        }
+        std::pop_heap(mMessageHeap.begin(), mMessageHeap.end(),
+                isMessageDueAfter<MessageHeapEntry>);
+        mMessageHeap.pop_back();
+        mMessageTombstones -= 1;
+    }
+    return nullptr;
+}
+
+const Looper::MessageEnvelope* Looper::peekReadyMessageLocked(nsecs_t now) {
+    if (mPrioritizedMessageCount == 0 && mReadyMessages.empty()) {
+        // Without priorities the ready order is the pending order, skip the ready heap.
+        const MessageEnvelope* envelope = peekMessageLocked();
+        return envelope != nullptr && envelope->uptime <= now ? envelope : nullptr;
+    }
+
+    // Move the messages that have become due over to the ready heap.  They are ranked
+    // there by their uptime pushed back by the aging interval once per priority class
+    // above theirs, so a lower priority message waits for higher priority ones, but not
+    // for those that became due more than that interval after it.
+    while (const MessageEnvelope* envelope = peekMessageLocked()) {
+        if (envelope->uptime > now) {
+            break;
+        }
+        const MessageHeapEntry entry = mMessageHeap.front();
+        std::pop_heap(mMessageHeap.begin(), mMessageHeap.end(),
+                isMessageDueAfter<MessageHeapEntry>);
+        mMessageHeap.pop_back();
+
+        const nsecs_t rank = entry.uptime + envelope->priority * mOptions.messagePriorityAging;
+        mReadyMessages.push_back({.uptime = rank, .seq = entry.seq, .slot = entry.slot});
+        std::push_heap(mReadyMessages.begin(), mReadyMessages.end(),
+                isMessageDueAfter<MessageHeapEntry>);
+    }
+
+    while (!mReadyMessages.empty()) {
+        const MessageHeapEntry& top = mReadyMessages.front();
+        const MessageEnvelope& envelope = mMessageEnvelopes[top.slot];
+        if (envelope.seq == top.seq) {
+            return &envelope;
+        }
+        std::pop_heap(mReadyMessages.begin(), mReadyMessages.end(),
+                isMessageDueAfter<MessageHeapEntry>);
+        mReadyMessages.pop_back();
+        mMessageTombstones -= 1;
+    }
+    return nullptr;
+}
+
+void Looper::popMessageLocked(nsecs_t now, sp<MessageHandler>* outHandler,
+        Message* outMessage) {
+    // The message comes from the ready heap, unless peekReadyMessageLocked() skipped it.
+    std::vector<MessageHeapEntry>& heap = mReadyMessages.empty() ? mMessageHeap : mReadyMessages;
+    const uint32_t slot = heap.front().slot;
+    std::pop_heap(heap.begin(), heap.end(), isMessageDueAfter<MessageHeapEntry>);
+    heap.pop_back();
+
+    MessageEnvelope& envelope = mMessageEnvelopes[slot];
+    *outMessage = envelope.message;
+    if (envelope.timer == 0) {
+        *outHandler = releaseMessageSlotLocked(slot);
+        return;
+    }
+
+    // Put the timer back for its next tick, keeping its seq so that its TimerId still
+    // finds the envelope.
+    *outHandler = envelope.handler;
+    Timer& timer = mTimers.find(envelope.timer)->second;
+    timer.deadline += timer.period;
+    if ((timer.flags & TIMER_SKIP_MISSED) && timer.deadline <= now) {
+        timer.deadline += ((now - timer.deadline) / timer.period + 1) * timer.period;
+    }
+    envelope.uptime = roundUpToGranularity(timer.deadline, timer.granularity);
+    pushMessageHeapLocked(envelope.uptime, envelope.seq, slot);
+}
+
+sp<MessageHandler> Looper::releaseMessageSlotLocked(uint32_t slot) {
+    MessageEnvelope* envelopes = mMessageEnvelopes.data();
+    MessageEnvelope& envelope = envelopes[slot];
+
+    if (envelope.timer != 0) {
+        envelope.timer = 0;
+    } else {
+        unlinkMessageLocked(slot);
+    }
+    if (envelope.priority != MESSAGE_PRIORITY_NORMAL) {
+        mPrioritizedMessageCount -= 1;
+    }
+
+    envelope.seq = 0;
+    mFreeMessageSlots.push_back(slot);
+    mStats.messageQueueDepth.store(mMessageEnvelopes.size() - mFreeMessageSlots.size(),
+            std::memory_order_relaxed);
+    return std::move(envelope.handler);
+}
+
+void Looper::unlinkMessageLocked(uint32_t slot) {
+    MessageEnvelope* envelopes = mMessageEnvelopes.data();
+    MessageEnvelope& envelope = envelopes[slot];
+
+    if (envelope.prevByHandler != NO_MESSAGE_SLOT) {
+        envelopes[envelope.prevByHandler].nextByHandler = envelope.nextByHandler;
+    } else if (envelope.nextByHandler != NO_MESSAGE_SLOT) {
+        mMessagesByHandler[envelope.handler.get()] = envelope.nextByHandler;
+    } else {
+        mMessagesByHandler.erase(envelope.handler.get());
+    }
+    if (envelope.nextByHandler != NO_MESSAGE_SLOT) {
+        envelopes[envelope.nextByHandler].prevByHandler = envelope.prevByHandler;
+    }
+
+    const MessageKey key = {envelope.handler.get(), envelope.message.what};
+    if (envelope.prevByWhat != NO_MESSAGE_SLOT) {
+        envelopes[envelope.prevByWhat].nextByWhat = envelope.nextByWhat;
+    } else if (envelope.nextByWhat != NO_MESSAGE_SLOT) {
+        mMessagesByWhat[key] = envelope.nextByWhat;
+    } else {
+        mMessagesByWhat.erase(key);
+    }
+    if (envelope.nextByWhat != NO_MESSAGE_SLOT) {
+        envelopes[envelope.nextByWhat].prevByWhat = envelope.prevByWhat;
+    }
+}
+
+void Looper::drainInboxLocked() {
+    InboxMessage* head = mInbox.exchange(nullptr, std::memory_order_acquire);
+    if (head == nullptr) {
+        return;
+    }
+
+    // The inbox is a stack, reverse it so that messages are enqueued in the order
+    // in which they were posted.
+    InboxMessage* inboxMessage = nullptr;
+    while (head != nullptr) {
+        InboxMessage* next = head->next;
+        head->next = inboxMessage;
+        inboxMessage = head;
+        head = next;
+    }
+    while (inboxMessage != nullptr) {
+        InboxMessage* next = inboxMessage->next;
+        enqueueMessageLocked(inboxMessage->uptime, inboxMessage->priority, inboxMessage->handler,
+                inboxMessage->message);
+        delete inboxMessage;
+        inboxMessage = next;
+    }
+}
+
+void Looper::compactMessageHeapLocked() {
+    // Tombstones are normally discarded as they reach the top of the heap, but a burst
+    // of cancellations of far-off messages could otherwise grow the heap without bound.
+    if (mMessageTombstones < MIN_MESSAGE_TOMBSTONES_TO_COMPACT
+            || mMessageTombstones * 2 < mMessageHeap.size() + mReadyMessages.size()) {
+        return;
+    }
+    for (std::vector<MessageHeapEntry>* heap : {&mMessageHeap, &mReadyMessages}) {
+        heap->erase(std::remove_if(heap->begin(), heap->end(),
+                [this](const MessageHeapEntry& entry) {
+                    return mMessageEnvelopes[entry.slot].seq != entry.seq;
+                }), heap->end());
+        std::make_heap(heap->begin(), heap->end(), isMessageDueAfter<MessageHeapEntry>);
+    }
+    mMessageTombstones = 0;
+}
+
+nsecs_t Looper::getMessageWakeupTimeLocked(nsecs_t uptime, nsecs_t now) {
+    if (mOptions.messageSlack <= 0 || uptime <= now) {
+        return uptime;
+    }
+
+    // Find the last message due within the slack of the head.  Entries due later than
+    // that have no descendant due earlier, so the walk only visits the messages inside
+    // the window, and gives up on the exact time when there are too many of them.
+    const nsecs_t windowEnd = uptime + mOptions.messageSlack;
+    nsecs_t wakeupTime = uptime;
+    size_t pending[MAX_COALESCED_MESSAGES];
+    size_t pendingCount = 0;
+    pending[pendingCount++] = 0;
+    while (pendingCount > 0) {
+        const size_t index = pending[--pendingCount];
+        const MessageHeapEntry& entry = mMessageHeap[index];
+        if (entry.uptime > windowEnd) {
+            continue;
+        }
+        if (mMessageEnvelopes[entry.slot].seq == entry.seq) {
+            wakeupTime = std::max(wakeupTime, entry.uptime);
+        }
+        for (size_t child = index * 2 + 1; child <= index * 2 + 2; child++) {
+            if (child < mMessageHeap.size()) {
+                if (pendingCount == MAX_COALESCED_MESSAGES) {
+                    return windowEnd;
+                }
+                pending[pendingCount++] = child;
+            }
+        }
+    }
+    return wakeupTime;
+}
+
 void Looper::removeMessages(const sp<MessageHandler>& handler) {
 #if DEBUG_CALLBACKS
     ALOGD("%p ~ removeMessages - handler=%p", this, handler.get());
@@ -808,13 +1583,19 @@ void Looper::removeMessages(const sp<MessageHandler>& handler) {
 
     { // acquire lock
         AutoMutex _l(mLock);
+        drainInboxLocked();
 
-        for (size_t i = mMessageEnvelopes.size(); i != 0; ) {
-            const MessageEnvelope& messageEnvelope = mMessageEnvelopes.itemAt(--i);
-            if (messageEnvelope.handler == handler) {
-                mMessageEnvelopes.removeAt(i);
-            }
+        auto it = mMessagesByHandler.find(handler.get());
+        if (it == mMessagesByHandler.end()) {
+            return;
         }
+        for (uint32_t slot = it->second; slot != NO_MESSAGE_SLOT; ) {
+            const uint32_t next = mMessageEnvelopes[slot].nextByHandler;
+            releaseMessageSlotLocked(slot);
+            mMessageTombstones += 1;
+            slot = next;
+        }
+        compactMessageHeapLocked();
     } // release lock
 }
 
@@ -825,39 +1606,129 @@ void Looper::removeMessages(const sp<MessageHandler>& handler, int what) {
 
     { // acquire lock
         AutoMutex _l(mLock);
+        drainInboxLocked();
 
-        for (size_t i = mMessageEnvelopes.size(); i != 0; ) {
-            const MessageEnvelope& messageEnvelope = mMessageEnvelopes.itemAt(--i);
-            if (messageEnvelope.handler == handler
-                    && messageEnvelope.message.what == what) {
-                mMessageEnvelopes.removeAt(i);
-            }
+        auto it = mMessagesByWhat.find({handler.get(), what});
+        if (it == mMessagesByWhat.end()) {
+            return;
+        }
+        for (uint32_t slot = it->second; slot != NO_MESSAGE_SLOT; ) {
+            const uint32_t next = mMessageEnvelopes[slot].nextByWhat;
+            releaseMessageSlotLocked(slot);
+            mMessageTombstones += 1;
+            slot = next;
         }
+        compactMessageHeapLocked();
     } // release lock
 }
 
-bool Looper::isPolling() const {
-    return mPolling;
+Looper::TimerId Looper::addTimer(nsecs_t period, const sp<MessageHandler>& handler,
+        const Message& message, int flags, nsecs_t slack) {
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ addTimer - period=%" PRId64 ", handler=%p, what=%d, flags=0x%x, slack=%" PRId64,
+            this, period, handler.get(), message.what, flags, slack);
+#endif
+    LOG_ALWAYS_FATAL_IF(period <= 0, "Invalid timer period %" PRId64, period);
+
+    const nsecs_t granularity =
+            slack > 0 ? static_cast<nsecs_t>(std::bit_floor(static_cast<uint64_t>(slack))) : 0;
+    const nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + period;
+
+    TimerId timerId;
+    bool isHead;
+    { // acquire lock
+        AutoMutex _l(mLock);
+
+        const uint32_t slot = acquireMessageSlotLocked();
+        MessageEnvelope& envelope = mMessageEnvelopes[slot];
+        timerId = mNextMessageSeq++;
+        envelope.uptime = roundUpToGranularity(deadline, granularity);
+        envelope.seq = timerId;
+        envelope.priority = MESSAGE_PRIORITY_NORMAL;
+        envelope.handler = handler;
+        envelope.message = message;
+        envelope.timer = timerId;
+        mTimers.emplace(timerId, Timer{.slot = slot, .period = period,
+                .granularity = granularity, .deadline = deadline, .flags = flags});
+
+        isHead = pushMessageHeapLocked(envelope.uptime, timerId, slot);
+        if (mSendingMessage) {
+            return timerId;
+        }
+    } // release lock
+
+    if (isHead) {
+        wake();
+    }
+    return timerId;
 }
 
-#if HAVE_EPOLL
-uint32_t Looper::Request::getEpollEvents() const {
-    uint32_t epollEvents = 0;
-    if (events & EVENT_INPUT) epollEvents |= EPOLLIN;
-    if (events & EVENT_OUTPUT) epollEvents |= EPOLLOUT;
-    return epollEvents;
+bool Looper::cancelTimer(TimerId timer) {
+#if DEBUG_CALLBACKS
+    ALOGD("%p ~ cancelTimer - timer=%" PRIu64, this, timer);
+#endif
+
+    sp<MessageHandler> handler;
+    { // acquire lock
+        AutoMutex _l(mLock);
+        auto it = mTimers.find(timer);
+        if (it == mTimers.end()) {
+            return false;
+        }
+        handler = releaseMessageSlotLocked(it->second.slot);
+        mTimers.erase(it);
+        mMessageTombstones += 1;
+        compactMessageHeapLocked();
+    } // release lock, then the handler
+    return true;
 }
-#elif HAVE_KQUEUE
-Vector<int16_t> Looper::Request::getKqueueFilters() const {
-    Vector<int16_t> filters;
-    if (events & EVENT_INPUT) filters.push_back(EVFILT_READ);
-    if (events & EVENT_OUTPUT) filters.push_back(EVFILT_WRITE);
-    return filters;
+
+void Looper::setWatchdog(const sp<LooperWatchdog>& watchdog, nsecs_t callbackThreshold,
+        nsecs_t latenessThreshold) {
+    sp<LooperWatchdog> oldWatchdog;
+    { // acquire lock
+        AutoMutex _l(mLock);
+        oldWatchdog = std::move(mWatchdog);
+        mWatchdog = watchdog;
+        mWatchdogCallbackThreshold = callbackThreshold > 0 ? callbackThreshold : LLONG_MAX;
+        mWatchdogLatenessThreshold = latenessThreshold > 0 ? latenessThreshold : LLONG_MAX;
+    } // release lock, then the old watchdog
+}
+
+bool Looper::isPolling() const {
+    return mPolling.load(std::memory_order_relaxed);
+}
+
+Looper::Stats Looper::getStats() const {
+    Stats stats{};
+    stats.pollCount = mStats.pollCount.load(std::memory_order_relaxed);
+    stats.wakeCount = mStats.wakeCount.load(std::memory_order_relaxed);
+    stats.eventCount = mStats.eventCount.load(std::memory_order_relaxed);
+    stats.maxEventsPerPoll = mStats.maxEventsPerPoll.load(std::memory_order_relaxed);
+    stats.fullEventBatchCount = mStats.fullEventBatchCount.load(std::memory_order_relaxed);
+    stats.eventBatchSize = mStats.eventBatchSize.load(std::memory_order_relaxed);
+    stats.pollBackend = mStats.pollBackend.load(std::memory_order_relaxed);
+    stats.waitSyscallCount = mStats.waitSyscallCount.load(std::memory_order_relaxed);
+    stats.registrationSyscallCount =
+            mStats.registrationSyscallCount.load(std::memory_order_relaxed);
+    stats.pollSetRebuildCount = mStats.pollSetRebuildCount.load(std::memory_order_relaxed);
+    stats.blockedTime = mStats.blockedTime.load(std::memory_order_relaxed);
+    stats.dispatchTime = mStats.dispatchTime.load(std::memory_order_relaxed);
+    stats.messageQueueDepth = mStats.messageQueueDepth.load(std::memory_order_relaxed);
+    stats.messageCount = mStats.messageCount.load(std::memory_order_relaxed);
+    stats.totalMessageLateness = mStats.totalMessageLateness.load(std::memory_order_relaxed);
+    stats.maxMessageLateness = mStats.maxMessageLateness.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < CALLBACK_DURATION_BUCKETS; i++) {
+        stats.callbackDurationHistogram[i] =
+                mStats.callbackDurationHistogram[i].load(std::memory_order_relaxed);
+    }
+    return stats;
 }
-#endif
 
 MessageHandler::~MessageHandler() { }
 
 LooperCallback::~LooperCallback() { }
 
+LooperWatchdog::~LooperWatchdog() { }
+
 } // namespace android
\ No newline at end of file
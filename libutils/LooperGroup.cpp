@@ -0,0 +1,338 @@
+//
+// Copyright 2026 The Android Open Source Project
+//
+// A pool of looper threads sharing the execution of messages.
+//
+#define LOG_TAG "LooperGroup"
+
+#include <utils/LooperGroup.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+
+namespace android {
+
+namespace {
+
+// The group and index of the worker running on the current thread, if any.
+thread_local const LooperGroup* gCurrentGroup;
+thread_local size_t gCurrentWorker;
+
+}  // namespace
+
+// Forwards the delayed messages of a handler to the group once the looper finds them due.
+// The group only keeps us, and with us the handler, while we have messages queued.
+class LooperGroup::DelayedMessageHandler : public MessageHandler {
+public:
+    DelayedMessageHandler(LooperGroup* group, const sp<MessageHandler>& handler)
+        : mGroup(group), mHandler(handler) {}
+
+    virtual void handleMessage(const Message& message) {
+        sp<DelayedMessageHandler> forgotten;  // released after the lock
+        { // acquire lock
+            AutoMutex _l(mGroup->mLock);
+            // A message that was being dispatched as it got removed is no longer counted.
+            auto pending = pendingByWhat.find(message.what);
+            if (pending != pendingByWhat.end() && --pending->second == 0) {
+                pendingByWhat.erase(pending);
+                if (pendingByWhat.empty()) {
+                    forgotten = mGroup->forgetDelayedHandlerLocked(this);
+                }
+            }
+        } // release lock
+        mGroup->sendMessage(mHandler, message);
+    }
+
+    MessageHandler* getHandler() const { return mHandler.get(); }
+
+    // The number of messages queued with us on the looper by what, guarded by
+    // LooperGroup::mLock.
+    std::unordered_map<int, size_t> pendingByWhat;
+
+private:
+    // stop() removes the messages queued with us before the group goes away.
+    LooperGroup* const mGroup;
+    const sp<MessageHandler> mHandler;
+};
+
+LooperGroup::LooperGroup(size_t threadCount) : mStopping(false), mNextWorker(0) {
+    if (threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        auto worker = std::make_unique<Worker>();
+        worker->looper = sp<Looper>::make(false);
+        mWorkers.push_back(std::move(worker));
+    }
+    // Start the threads only once mWorkers is complete, since they steal from each other.
+    for (size_t i = 0; i < threadCount; i++) {
+        mWorkers[i]->thread = std::thread([this, i] { threadLoop(i); });
+    }
+}
+
+LooperGroup::~LooperGroup() {
+    stop();
+}
+
+size_t LooperGroup::getThreadCount() const {
+    return mWorkers.size();
+}
+
+const sp<Looper>& LooperGroup::getLooper(size_t index) const {
+    return mWorkers[index]->looper;
+}
+
+void LooperGroup::sendMessage(const sp<MessageHandler>& handler, const Message& message) {
+    AutoMutex _l(mLock);
+    // Checked under the lock, and the strand is scheduled under it, so that stop() finds
+    // every strand that gets queued.
+    if (mStopping.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::unique_ptr<Strand>& entry = mStrands[handler.get()];
+    if (entry == nullptr) {
+        entry = std::make_unique<Strand>();
+        entry->handler = handler;
+    }
+    Strand* strand = entry.get();
+    strand->messages.push_back(message);
+    if (strand->running) {
+        // Whoever is queued with or running the strand will get to this message.
+        return;
+    }
+    strand->running = true;
+    schedule(strand);
+}
+
+void LooperGroup::sendMessageDelayed(nsecs_t uptimeDelay, const sp<MessageHandler>& handler,
+        const Message& message) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    sendMessageAtTime(now + uptimeDelay, handler, message);
+}
+
+void LooperGroup::sendMessageAtTime(nsecs_t uptime, const sp<MessageHandler>& handler,
+        const Message& message) {
+    if (uptime <= systemTime(SYSTEM_TIME_MONOTONIC)) {
+        sendMessage(handler, message);
+        return;
+    }
+
+    // Let a looper keep the message until it is due, always the same one for a handler
+    // so that its delayed messages keep their order.
+    AutoMutex _l(mLock);
+    // Checked under the lock so that stop() finds every message queued this way.
+    if (mStopping.load(std::memory_order_relaxed)) {
+        return;
+    }
+    sp<DelayedMessageHandler>& delayedHandler = mDelayedHandlers[handler.get()];
+    if (delayedHandler == nullptr) {
+        delayedHandler = sp<DelayedMessageHandler>::make(this, handler);
+    }
+    delayedHandler->pendingByWhat[message.what]++;
+    getDelayedMessageLooper(handler.get())->sendMessageAtTime(uptime, delayedHandler, message);
+}
+
+void LooperGroup::removeMessages(const sp<MessageHandler>& handler) {
+    sp<DelayedMessageHandler> forgotten;  // released after the lock
+    AutoMutex _l(mLock);
+    auto strand = mStrands.find(handler.get());
+    if (strand != mStrands.end()) {
+        // The strand finishes once it finds no more messages.
+        strand->second->messages.clear();
+    }
+
+    auto delayedHandler = mDelayedHandlers.find(handler.get());
+    if (delayedHandler != mDelayedHandlers.end()) {
+        getDelayedMessageLooper(handler.get())->removeMessages(delayedHandler->second);
+        delayedHandler->second->pendingByWhat.clear();
+        forgotten = forgetDelayedHandlerLocked(delayedHandler->second.get());
+    }
+}
+
+void LooperGroup::removeMessages(const sp<MessageHandler>& handler, int what) {
+    sp<DelayedMessageHandler> forgotten;  // released after the lock
+    AutoMutex _l(mLock);
+    auto strand = mStrands.find(handler.get());
+    if (strand != mStrands.end()) {
+        std::erase_if(strand->second->messages,
+                [what](const Message& message) { return message.what == what; });
+    }
+
+    auto delayedHandler = mDelayedHandlers.find(handler.get());
+    if (delayedHandler != mDelayedHandlers.end()
+            && delayedHandler->second->pendingByWhat.erase(what) != 0) {
+        getDelayedMessageLooper(handler.get())->removeMessages(delayedHandler->second, what);
+        if (delayedHandler->second->pendingByWhat.empty()) {
+            forgotten = forgetDelayedHandlerLocked(delayedHandler->second.get());
+        }
+    }
+}
+
+const sp<Looper>& LooperGroup::getDelayedMessageLooper(MessageHandler* handler) const {
+    return mWorkers[std::hash<MessageHandler*>()(handler) % mWorkers.size()]->looper;
+}
+
+sp<LooperGroup::DelayedMessageHandler> LooperGroup::forgetDelayedHandlerLocked(
+        DelayedMessageHandler* delayedHandler) {
+    sp<DelayedMessageHandler> forgotten;
+    auto entry = mDelayedHandlers.find(delayedHandler->getHandler());
+    // The handler may have a new forwarder already.
+    if (entry != mDelayedHandlers.end() && entry->second == delayedHandler) {
+        forgotten = std::move(entry->second);
+        mDelayedHandlers.erase(entry);
+    }
+    return forgotten;
+}
+
+void LooperGroup::stop() {
+    LOG_ALWAYS_FATAL_IF(gCurrentGroup == this, "A LooperGroup cannot be stopped by its own thread");
+
+    if (mStopping.exchange(true)) {
+        return;
+    }
+    for (const auto& worker : mWorkers) {
+        worker->looper->wake();
+    }
+    for (const auto& worker : mWorkers) {
+        worker->thread.join();
+    }
+
+    // Drop the strands outside of the lock, their handlers may do anything when released.
+    std::unordered_map<MessageHandler*, std::unique_ptr<Strand>> strands;
+    std::unordered_map<MessageHandler*, sp<DelayedMessageHandler>> delayedHandlers;
+    { // acquire lock
+        AutoMutex _l(mLock);
+        strands.swap(mStrands);
+        delayedHandlers.swap(mDelayedHandlers);
+        for (const auto& worker : mWorkers) {
+            AutoMutex _w(worker->lock);
+            worker->runQueue.clear();
+        }
+    } // release lock
+
+    // The loopers may be polled after we are gone, take back the delayed messages that
+    // would call into us.
+    for (const auto& [handler, delayedHandler] : delayedHandlers) {
+        getDelayedMessageLooper(handler)->removeMessages(delayedHandler);
+    }
+}
+
+void LooperGroup::schedule(Strand* strand) {
+    // Prefer the worker posting the message, whose cache is likely warm, otherwise go
+    // round-robin.
+    size_t index;
+    if (gCurrentGroup == this) {
+        index = gCurrentWorker;
+    } else {
+        index = mNextWorker.fetch_add(1, std::memory_order_relaxed) % mWorkers.size();
+    }
+
+    Worker& worker = *mWorkers[index];
+    { // acquire lock
+        AutoMutex _l(worker.lock);
+        worker.runQueue.push_back(strand);
+    } // release lock
+    worker.looper->wake();
+
+    // If that worker is busy, get an idle one to steal the strand.  Pairs with the fence
+    // in threadLoop(): either the idle worker sees the strand before sleeping, or we see
+    // it idle here.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!worker.idle.load(std::memory_order_relaxed)) {
+        for (const auto& other : mWorkers) {
+            if (other.get() != &worker && other->idle.load(std::memory_order_relaxed)) {
+                other->looper->wake();
+                break;
+            }
+        }
+    }
+}
+
+LooperGroup::Strand* LooperGroup::takeStrand(size_t index) {
+    { // acquire lock
+        Worker& worker = *mWorkers[index];
+        AutoMutex _l(worker.lock);
+        if (!worker.runQueue.empty()) {
+            Strand* strand = worker.runQueue.front();
+            worker.runQueue.pop_front();
+            return strand;
+        }
+    } // release lock
+
+    // Steal the strand that its worker would get to last.
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        Worker& victim = *mWorkers[(index + i) % mWorkers.size()];
+        AutoMutex _l(victim.lock);
+        if (!victim.runQueue.empty()) {
+            Strand* strand = victim.runQueue.back();
+            victim.runQueue.pop_back();
+            return strand;
+        }
+    }
+    return nullptr;
+}
+
+bool LooperGroup::hasQueuedStrands() const {
+    for (const auto& worker : mWorkers) {
+        AutoMutex _l(worker->lock);
+        if (!worker->runQueue.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LooperGroup::runStrand(size_t index, Strand* strand) {
+    sp<MessageHandler> handler = strand->handler;
+    for (size_t i = 0; ; i++) {
+        Message message;
+        { // acquire lock
+            AutoMutex _l(mLock);
+            if (strand->messages.empty()) {
+                // The strand is done, forget it until the handler gets another message.
+                mStrands.erase(handler.get());
+                break;
+            }
+            if (i == STRAND_BATCH_SIZE) {
+                // Let the other strands queued here go first.
+                Worker& worker = *mWorkers[index];
+                AutoMutex _w(worker.lock);
+                worker.runQueue.push_back(strand);
+                break;
+            }
+            message = strand->messages.front();
+            strand->messages.pop_front();
+        } // release lock
+
+        handler->handleMessage(message);
+    }
+} // release handler
+
+void LooperGroup::threadLoop(size_t index) {
+    Worker& worker = *mWorkers[index];
+    gCurrentGroup = this;
+    gCurrentWorker = index;
+    Looper::setForThread(worker.looper);
+
+    while (!mStopping.load(std::memory_order_relaxed)) {
+        if (Strand* strand = takeStrand(index)) {
+            runStrand(index, strand);
+            // Keep up with the fds and delayed messages of our looper while busy.
+            worker.looper->pollOnce(0);
+            continue;
+        }
+
+        worker.idle.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!hasQueuedStrands() && !mStopping.load(std::memory_order_relaxed)) {
+            worker.looper->pollOnce(-1);
+        }
+        worker.idle.store(false, std::memory_order_relaxed);
+    }
+
+    Looper::setForThread(nullptr);
+    gCurrentGroup = nullptr;
+}
+
+} // namespace android
@@ -0,0 +1,236 @@
+//
+// Copyright 2026 The Android Open Source Project
+//
+// Routes file descriptors and messages to per-core loopers.
+//
+#define LOG_TAG "LooperRouter"
+
+#include <utils/LooperRouter.h>
+#include <utils/Log.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <bit>
+
+namespace android {
+
+namespace {
+
+constexpr size_t NO_SHARD = SIZE_MAX;
+
+std::atomic<uint64_t> gNextRouterId{1};
+
+// The router last resolved on this thread, and the shard of the thread in it.
+thread_local uint64_t gCachedRouterId;
+thread_local size_t gCachedShard;
+
+// Spreads keys that differ only in their high bits, such as pointers, over the shards.
+uint64_t mixKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+}  // namespace
+
+// Drains the channels into a shard when its doorbell rings.
+class LooperRouter::DoorbellCallback : public LooperCallback {
+public:
+    DoorbellCallback(const wp<LooperRouter>& router, size_t index)
+        : mRouter(router), mIndex(index) {}
+
+    virtual int handleEvent(int, int, void*) {
+        sp<LooperRouter> router = mRouter.promote();
+        if (router == nullptr) {
+            return 0;
+        }
+        router->drain(mIndex);
+        return 1;
+    }
+
+private:
+    const wp<LooperRouter> mRouter;
+    const size_t mIndex;
+};
+
+// --- LooperRouter::Ring ---
+
+LooperRouter::Ring::Ring(size_t capacity)
+    : mSlots(std::bit_ceil(std::max<size_t>(capacity, 2))),
+      mMask(mSlots.size() - 1),
+      mHead(0),
+      mTail(0) {
+}
+
+bool LooperRouter::Ring::push(const sp<MessageHandler>& handler, const Message& message) {
+    const size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail - mHead.load(std::memory_order_acquire) == mSlots.size()) {
+        return false;
+    }
+    RoutedMessage& slot = mSlots[tail & mMask];
+    slot.handler = handler;
+    slot.message = message;
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool LooperRouter::Ring::pop(RoutedMessage* outMessage) {
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    if (head == mTail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    *outMessage = std::move(mSlots[head & mMask]);
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// --- LooperRouter ---
+
+LooperRouter::LooperRouter(const std::vector<sp<Looper>>& loopers, size_t ringCapacity)
+    : mId(gNextRouterId.fetch_add(1, std::memory_order_relaxed)),
+      mRingCapacity(ringCapacity) {
+    LOG_ALWAYS_FATAL_IF(loopers.empty(), "A LooperRouter needs at least one looper");
+
+    for (const sp<Looper>& looper : loopers) {
+        auto shard = std::make_unique<Shard>();
+        shard->looper = looper;
+        int fds[2];
+        LOG_ALWAYS_FATAL_IF(pipe(fds) != 0, "Could not make doorbell pipe: %s", strerror(errno));
+        shard->doorbellReadFd.reset(fds[0]);
+        shard->doorbellWriteFd.reset(fds[1]);
+        for (int fd : fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        for (size_t i = 0; i < loopers.size(); i++) {
+            shard->channels.push_back(std::make_unique<Channel>(mRingCapacity));
+        }
+        mShards.push_back(std::move(shard));
+    }
+
+    // The callbacks only hold weak references, so that they do not keep us alive.
+    for (size_t i = 0; i < mShards.size(); i++) {
+        mShards[i]->looper->addFd(mShards[i]->doorbellReadFd.get(), Looper::POLL_CALLBACK,
+                Looper::EVENT_INPUT, sp<DoorbellCallback>::make(wp<LooperRouter>(this), i),
+                nullptr);
+    }
+}
+
+LooperRouter::~LooperRouter() {
+    for (const auto& shard : mShards) {
+        shard->looper->removeFd(shard->doorbellReadFd.get());
+    }
+}
+
+size_t LooperRouter::getShardCount() const {
+    return mShards.size();
+}
+
+size_t LooperRouter::getShardForKey(uint64_t key) const {
+    return mixKey(key) % mShards.size();
+}
+
+const sp<Looper>& LooperRouter::getLooperForKey(uint64_t key) const {
+    return mShards[getShardForKey(key)]->looper;
+}
+
+int LooperRouter::addFd(uint64_t key, int fd, int ident, int events,
+        const sp<LooperCallback>& callback, void* data) {
+    return getLooperForKey(key)->addFd(fd, ident, events, callback, data);
+}
+
+int LooperRouter::removeFd(uint64_t key, int fd) {
+    return getLooperForKey(key)->removeFd(fd);
+}
+
+void LooperRouter::sendMessage(uint64_t key, const sp<MessageHandler>& handler,
+        const Message& message) {
+    const size_t source = getCurrentShard();
+    Shard& destination = *mShards[getShardForKey(key)];
+    if (source == NO_SHARD) {
+        destination.looper->sendMessage(handler, message);
+        return;
+    }
+
+    Channel& channel = *destination.channels[source];
+    if (channel.overflowing.load(std::memory_order_relaxed)
+            || !channel.ring.push(handler, message)) {
+        AutoMutex _l(channel.overflowLock);
+        channel.overflow.push_back({handler, message});
+        channel.overflowing.store(true, std::memory_order_relaxed);
+    }
+    ringDoorbell(destination);
+}
+
+size_t LooperRouter::getCurrentShard() const {
+    if (gCachedRouterId != mId) {
+        sp<Looper> looper = Looper::getForThread();
+        gCachedShard = NO_SHARD;
+        for (size_t i = 0; i < mShards.size(); i++) {
+            if (mShards[i]->looper == looper) {
+                gCachedShard = i;
+                break;
+            }
+        }
+        gCachedRouterId = mId;
+    }
+    return gCachedShard;
+}
+
+void LooperRouter::ringDoorbell(Shard& shard) {
+    // Pairs with the fence in drain(): either it sees our message after clearing the
+    // pending doorbell, or we see the doorbell cleared and ring it again.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shard.doorbellPending.exchange(true)) {
+        return;
+    }
+    const char signal = 1;
+    if (TEMP_FAILURE_RETRY(write(shard.doorbellWriteFd.get(), &signal, 1)) < 0
+            && errno != EAGAIN) {
+        ALOGW("Could not ring doorbell: %s", strerror(errno));
+    }
+}
+
+void LooperRouter::drain(size_t index) {
+    Shard& shard = *mShards[index];
+    shard.doorbellPending.store(false, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    char buffer[64];
+    while (TEMP_FAILURE_RETRY(read(shard.doorbellReadFd.get(), buffer, sizeof(buffer)))
+            == sizeof(buffer)) {
+    }
+
+    // Take at most a ring's worth from each producer, so that a busy one cannot keep us
+    // here forever, and ring again for the rest.
+    bool more = false;
+    for (const auto& channel : shard.channels) {
+        RoutedMessage routed;
+        size_t count = 0;
+        for (; count < mRingCapacity && channel->ring.pop(&routed); count++) {
+            routed.handler->handleMessage(routed.message);
+        }
+        if (count == mRingCapacity) {
+            more = true;
+            continue;
+        }
+        // The ring is empty, so everything still to come is in the overflow list.
+        if (channel->overflowing.load(std::memory_order_relaxed)) {
+            std::vector<RoutedMessage> overflow;
+            { // acquire lock
+                AutoMutex _l(channel->overflowLock);
+                overflow.swap(channel->overflow);
+                channel->overflowing.store(false, std::memory_order_relaxed);
+            } // release lock
+            for (const RoutedMessage& message : overflow) {
+                message.handler->handleMessage(message.message);
+            }
+        }
+    }
+    if (more) {
+        ringDoorbell(shard);
+    }
+}
+
+} // namespace android
@@ -0,0 +1,695 @@
+//
+// Copyright 2026 The Android Open Source Project
+//
+// The kernel interfaces a Looper can wait for file descriptor events with.
+//
+#define LOG_TAG "PollBackend"
+
+#include "PollBackend.h"
+
+#include <utils/Log.h>
+#include <utils/Looper.h>
+#include <utils/unique_fd.h>
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <vector>
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#elif HAVE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#if HAVE_IO_URING
+#include "IoUringPoller.h"
+#endif
+
+namespace android {
+
+namespace {
+
+#if HAVE_EPOLL_PWAIT2 || HAVE_KQUEUE
+struct timespec nanosecondsToTimespec(nsecs_t nanos) {
+    return {.tv_sec = static_cast<time_t>(nanos / 1000000000),
+            .tv_nsec = static_cast<long>(nanos % 1000000000)};
+}
+#endif
+
+// Round up to the millisecond, waking up early would only make us poll again.
+int nanosecondsToPollTimeout(nsecs_t timeoutNanos) {
+    return timeoutNanos < 0 ? -1 : toMillisecondTimeoutDelay(0, timeoutNanos);
+}
+
+// The poll(2) events of a registration, which also serve for io_uring polls.
+short getPollEvents(int events) {
+    short pollEvents = 0;
+    if (events & Looper::EVENT_INPUT) pollEvents |= POLLIN;
+    if (events & Looper::EVENT_OUTPUT) pollEvents |= POLLOUT;
+    return pollEvents;
+}
+
+int getLooperEventsFromPoll(uint32_t pollEvents) {
+    int events = 0;
+    if (pollEvents & POLLIN) events |= Looper::EVENT_INPUT;
+    if (pollEvents & POLLOUT) events |= Looper::EVENT_OUTPUT;
+    if (pollEvents & POLLERR) events |= Looper::EVENT_ERROR;
+    if (pollEvents & POLLHUP) events |= Looper::EVENT_HANGUP;
+    if (pollEvents & POLLNVAL) events |= Looper::EVENT_INVALID;
+    return events;
+}
+
+// Registrations by file descriptor, for backends that keep track of them themselves.
+template <typename Registration>
+Registration* findRegistration(std::vector<Registration>& registrations, int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= registrations.size()
+            || registrations[fd].seq == 0) {
+        return nullptr;
+    }
+    return &registrations[fd];
+}
+
+}  // namespace
+
+#if HAVE_EPOLL
+// --- EpollBackend ---
+
+namespace {
+
+#if HAVE_EPOLL_PWAIT2
+// Set once epoll_pwait2() turns out to be missing from the kernel (it came with 5.11).
+std::atomic<bool> gNoEpollPwait2;
+#endif
+
+uint32_t getEpollEvents(int events) {
+    uint32_t epollEvents = 0;
+    if (events & Looper::EVENT_INPUT) epollEvents |= EPOLLIN;
+    if (events & Looper::EVENT_OUTPUT) epollEvents |= EPOLLOUT;
+    if (events & Looper::EVENT_EDGE_TRIGGERED) epollEvents |= EPOLLET;
+    if (events & Looper::EVENT_ONESHOT) epollEvents |= EPOLLONESHOT;
+    return epollEvents;
+}
+
+int getLooperEventsFromEpoll(uint32_t epollEvents) {
+    int events = 0;
+    if (epollEvents & EPOLLIN) events |= Looper::EVENT_INPUT;
+    if (epollEvents & EPOLLOUT) events |= Looper::EVENT_OUTPUT;
+    if (epollEvents & EPOLLERR) events |= Looper::EVENT_ERROR;
+    if (epollEvents & EPOLLHUP) events |= Looper::EVENT_HANGUP;
+    return events;
+}
+
+class EpollBackend : public PollBackend {
+public:
+    EpollBackend(android::base::unique_fd epollFd, std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls)
+        : PollBackend(Looper::POLL_BACKEND_EPOLL, waitSyscalls, registrationSyscalls),
+          mEpollFd(std::move(epollFd)) {}
+
+    int addFd(int fd, int events, uint64_t seq) override {
+        return control(EPOLL_CTL_ADD, fd, events, seq);
+    }
+
+    int modifyFd(int fd, int, int events, uint64_t seq) override {
+        return control(EPOLL_CTL_MOD, fd, events, seq);
+    }
+
+    int removeFd(int fd, int, uint64_t) override {
+        return control(EPOLL_CTL_DEL, fd, 0, 0);
+    }
+
+    // epoll keys registrations by file and fd number, and only drops them when the file
+    // is released.
+    bool keepsRegistrationsOfClosedFds() const override { return true; }
+
+    int wait(PollEvent* events, int maxEvents, nsecs_t timeoutNanos) override {
+        if (mEventItems.size() < static_cast<size_t>(maxEvents)) {
+            mEventItems.resize(maxEvents);
+        }
+        const int eventCount = waitForEvents(maxEvents, timeoutNanos);
+        for (int i = 0; i < eventCount; i++) {
+            events[i] = {.seq = mEventItems[i].data.u64,
+                         .events = getLooperEventsFromEpoll(mEventItems[i].events)};
+        }
+        return eventCount;
+    }
+
+private:
+    int control(int op, int fd, int events, uint64_t seq) {
+        epoll_event eventItem = {.events = getEpollEvents(events), .data = {.u64 = seq}};
+        countRegistrationSyscalls();
+        return epoll_ctl(mEpollFd.get(), op, fd, &eventItem) == 0 ? 0 : errno;
+    }
+
+    int waitForEvents(int maxEvents, nsecs_t timeoutNanos) {
+        countWaitSyscalls();
+#if HAVE_EPOLL_PWAIT2
+        if (!gNoEpollPwait2.load(std::memory_order_relaxed)) {
+            struct timespec timeout = nanosecondsToTimespec(timeoutNanos);
+            int result = epoll_pwait2(mEpollFd.get(), mEventItems.data(), maxEvents,
+                    timeoutNanos < 0 ? nullptr : &timeout, nullptr);
+            if (result >= 0 || errno != ENOSYS) {
+                return result;
+            }
+            gNoEpollPwait2.store(true, std::memory_order_relaxed);
+            countWaitSyscalls();
+        }
+#endif
+        return epoll_wait(mEpollFd.get(), mEventItems.data(), maxEvents,
+                nanosecondsToPollTimeout(timeoutNanos));
+    }
+
+    const android::base::unique_fd mEpollFd;
+    std::vector<epoll_event> mEventItems;  // only used by the polling thread
+};
+
+}  // namespace
+#endif
+
+#if HAVE_KQUEUE
+// --- KqueueBackend ---
+
+namespace {
+
+class KqueueBackend : public PollBackend {
+public:
+    KqueueBackend(android::base::unique_fd kqueueFd, std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls)
+        : PollBackend(Looper::POLL_BACKEND_KQUEUE, waitSyscalls, registrationSyscalls),
+          mKqueueFd(std::move(kqueueFd)) {}
+
+    int addFd(int fd, int events, uint64_t seq) override {
+        return control(fd, events, 0, seq);
+    }
+
+    // Adding a filter that exists updates it, so only the filters that are no longer
+    // wanted need deleting.
+    int modifyFd(int fd, int oldEvents, int events, uint64_t seq) override {
+        return control(fd, events, oldEvents & ~events, seq);
+    }
+
+    int removeFd(int fd, int events, uint64_t seq) override {
+        return control(fd, 0, events, seq);
+    }
+
+    // All the changes go in one changelist.  EV_RECEIPT has kevent() report the result of
+    // every change in order, instead of stopping at the first one that fails.
+    void applyChanges(PollChange* changes, size_t count) override {
+        std::vector<struct kevent> changelist(count * MAX_CHANGES_PER_FD);
+        std::vector<size_t> owners(changelist.size());
+        size_t changeCount = 0;
+        for (size_t i = 0; i < count; i++) {
+            PollChange& change = changes[i];
+            change.result = 0;
+            int addEvents = 0;
+            int deleteEvents = 0;
+            switch (change.op) {
+                case PollChange::ADD:
+                    addEvents = change.events;
+                    break;
+                case PollChange::MODIFY:
+                    addEvents = change.events;
+                    deleteEvents = change.oldEvents & ~change.events;
+                    break;
+                case PollChange::REMOVE:
+                    deleteEvents = change.events;
+                    break;
+            }
+            const size_t fdChangeCount = makeChanges(&changelist[changeCount], change.fd,
+                    addEvents, deleteEvents, change.seq, EV_RECEIPT);
+            std::fill_n(&owners[changeCount], fdChangeCount, i);
+            changeCount += fdChangeCount;
+        }
+        if (changeCount == 0) {
+            return;
+        }
+
+        std::vector<struct kevent> receipts(changeCount);
+        countRegistrationSyscalls();
+        const int receiptCount = kevent(mKqueueFd.get(), changelist.data(), changeCount,
+                receipts.data(), changeCount, nullptr);
+        if (receiptCount < 0) {
+            const int error = errno;
+            for (size_t i = 0; i < count; i++) {
+                changes[i].result = error;
+            }
+            return;
+        }
+        for (int i = 0; i < receiptCount; i++) {
+            PollChange& change = changes[owners[i]];
+            if ((receipts[i].flags & EV_ERROR) && receipts[i].data != 0 && change.result == 0) {
+                change.result = static_cast<int>(receipts[i].data);
+            }
+        }
+    }
+
+    int wait(PollEvent* events, int maxEvents, nsecs_t timeoutNanos) override {
+        if (mEventItems.size() < static_cast<size_t>(maxEvents)) {
+            mEventItems.resize(maxEvents);
+        }
+        struct timespec timeout = nanosecondsToTimespec(timeoutNanos);
+        countWaitSyscalls();
+        const int eventCount = kevent(mKqueueFd.get(), nullptr, 0, mEventItems.data(),
+                maxEvents, timeoutNanos < 0 ? nullptr : &timeout);
+        // Each filter reports on its own, so the reads and writes of an fd come as two events.
+        for (int i = 0; i < eventCount; i++) {
+            const struct kevent& eventItem = mEventItems[i];
+            int looperEvents = 0;
+            if (eventItem.filter == EVFILT_READ) looperEvents |= Looper::EVENT_INPUT;
+            if (eventItem.filter == EVFILT_WRITE) looperEvents |= Looper::EVENT_OUTPUT;
+            if (eventItem.flags & EV_ERROR) looperEvents |= Looper::EVENT_ERROR;
+            if (eventItem.flags & EV_EOF) looperEvents |= Looper::EVENT_HANGUP;
+            events[i] = {.seq = reinterpret_cast<uint64_t>(eventItem.udata),
+                         .events = looperEvents};
+        }
+        return eventCount;
+    }
+
+private:
+    // An fd has a read and a write filter, each of which may be added or deleted.
+    static constexpr size_t MAX_CHANGES_PER_FD = 4;
+
+    // Stores the changes that add the filters of addEvents and delete those of
+    // deleteEvents, returns how many there are.
+    static size_t makeChanges(struct kevent* changes, int fd, int addEvents, int deleteEvents,
+            uint64_t seq, uint16_t extraFlags) {
+        uint16_t addFlags = EV_ADD | EV_ENABLE | extraFlags;
+        if (addEvents & Looper::EVENT_EDGE_TRIGGERED) addFlags |= EV_CLEAR;
+        // EV_DISPATCH rather than EV_ONESHOT, which would delete the filter after the first
+        // event and make removing the file descriptor fail, like EPOLLONESHOT it only
+        // disables the filter until it is added again.
+        if (addEvents & Looper::EVENT_ONESHOT) addFlags |= EV_DISPATCH;
+        const uint16_t deleteFlags = EV_DELETE | extraFlags;
+
+        size_t changeCount = 0;
+        auto change = [&](int16_t filter, uint16_t flags) {
+            EV_SET(&changes[changeCount++], fd, filter, flags, 0, 0,
+                   reinterpret_cast<void*>(seq));
+        };
+        if (addEvents & Looper::EVENT_INPUT) change(EVFILT_READ, addFlags);
+        if (addEvents & Looper::EVENT_OUTPUT) change(EVFILT_WRITE, addFlags);
+        if (deleteEvents & Looper::EVENT_INPUT) change(EVFILT_READ, deleteFlags);
+        if (deleteEvents & Looper::EVENT_OUTPUT) change(EVFILT_WRITE, deleteFlags);
+        return changeCount;
+    }
+
+    // Adds the filters of addEvents and deletes those of deleteEvents in one call.
+    int control(int fd, int addEvents, int deleteEvents, uint64_t seq) {
+        struct kevent changes[MAX_CHANGES_PER_FD];
+        const size_t changeCount = makeChanges(changes, fd, addEvents, deleteEvents, seq, 0);
+        if (changeCount == 0) {
+            return 0;
+        }
+        countRegistrationSyscalls();
+        return kevent(mKqueueFd.get(), changes, changeCount, nullptr, 0, nullptr) < 0 ? errno
+                                                                                     : 0;
+    }
+
+    const android::base::unique_fd mKqueueFd;
+    std::vector<struct kevent> mEventItems;  // only used by the polling thread
+};
+
+}  // namespace
+#endif
+
+// --- PosixPollBackend ---
+
+namespace {
+
+// Polls with poll(2), which every platform has.  The set of file descriptors is handed to
+// the kernel by each wait, so registrations cost no system call, but the looper has to be
+// woken for changes to reach a wait that is already blocked, and each wait costs time
+// linear in the number of file descriptors.  poll(2) cannot wait for edges, so
+// EVENT_EDGE_TRIGGERED is not supported, and it only waits with millisecond precision.
+class PosixPollBackend : public PollBackend {
+public:
+    PosixPollBackend(std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls)
+        : PollBackend(Looper::POLL_BACKEND_POLL, waitSyscalls, registrationSyscalls) {}
+
+    int addFd(int fd, int events, uint64_t seq) override {
+        if (events & Looper::EVENT_EDGE_TRIGGERED) {
+            return EINVAL;
+        }
+        if (fd < 0) {
+            return EBADF;
+        }
+        if (findRegistration(mRegistrations, fd) != nullptr) {
+            return EEXIST;
+        }
+        if (static_cast<size_t>(fd) >= mRegistrations.size()) {
+            mRegistrations.resize(fd + 1);
+        }
+        mRegistrations[fd] = {.seq = seq, .events = events, .index = mPollFds.size()};
+        mPollFds.push_back({.fd = fd, .events = getPollEvents(events), .revents = 0});
+        mFds.push_back(fd);
+        mChanged.store(true);
+        return 0;
+    }
+
+    int modifyFd(int fd, int, int events, uint64_t seq) override {
+        if (events & Looper::EVENT_EDGE_TRIGGERED) {
+            return EINVAL;
+        }
+        Registration* registration = findRegistration(mRegistrations, fd);
+        if (registration == nullptr) {
+            return ENOENT;
+        }
+        registration->seq = seq;
+        registration->events = events;
+        mPollFds[registration->index] = {.fd = fd, .events = getPollEvents(events), .revents = 0};
+        mChanged.store(true);
+        return 0;
+    }
+
+    int removeFd(int fd, int, uint64_t) override {
+        Registration* registration = findRegistration(mRegistrations, fd);
+        if (registration == nullptr) {
+            return ENOENT;
+        }
+        // Move the last entry into the hole.
+        const size_t index = registration->index;
+        mPollFds[index] = mPollFds.back();
+        mFds[index] = mFds.back();
+        mRegistrations[mFds[index]].index = index;
+        mPollFds.pop_back();
+        mFds.pop_back();
+        registration->seq = 0;
+        mChanged.store(true);
+        return 0;
+    }
+
+    bool flushChanges() override { return false; }
+
+    bool needsPrepareWait() const override { return mChanged.load(); }
+
+    void prepareWaitLocked() override {
+        mChanged.store(false, std::memory_order_relaxed);
+        mWaitFds = mPollFds;
+        mWaitSeqs.resize(mFds.size());
+        for (size_t i = 0; i < mFds.size(); i++) {
+            mWaitSeqs[i] = mRegistrations[mFds[i]].seq;
+        }
+        mNextIndex = 0;
+    }
+
+    int wait(PollEvent* events, int maxEvents, nsecs_t timeoutNanos) override {
+        if (mReportedFds.size() < static_cast<size_t>(maxEvents)) {
+            mReportedFds.resize(maxEvents);
+        }
+        countWaitSyscalls();
+        const int readyCount = poll(mWaitFds.data(), mWaitFds.size(),
+                nanosecondsToPollTimeout(timeoutNanos));
+        if (readyCount <= 0) {
+            return readyCount;
+        }
+        // Take turns at the front when more are ready than fit, so that the file
+        // descriptors at the end of the set are not starved.
+        const size_t fdCount = mWaitFds.size();
+        int eventCount = 0;
+        size_t i = 0;
+        for (; i < fdCount && eventCount < maxEvents; i++) {
+            const size_t index = (mNextIndex + i) % fdCount;
+            if (mWaitFds[index].revents != 0) {
+                mReportedFds[eventCount] = mWaitFds[index].fd;
+                events[eventCount++] = {.seq = mWaitSeqs[index],
+                        .events = getLooperEventsFromPoll(mWaitFds[index].revents)};
+            }
+        }
+        mNextIndex = (mNextIndex + i) % fdCount;
+        return eventCount;
+    }
+
+    // One-shot registrations are left out of the set once they reported, until repolled.
+    int resolveEventsLocked(PollEvent* events, int eventCount) override {
+        for (int i = 0; i < eventCount; i++) {
+            Registration* registration = findRegistration(mRegistrations, mReportedFds[i]);
+            if (registration != nullptr && registration->seq == events[i].seq
+                    && (registration->events & Looper::EVENT_ONESHOT)) {
+                mPollFds[registration->index].fd = -1;
+                mChanged.store(true);
+            }
+        }
+        return eventCount;
+    }
+
+private:
+    struct Registration {
+        uint64_t seq = 0;  // 0 when the fd is not registered
+        int events = 0;
+        size_t index = 0;  // into mPollFds and mFds
+    };
+
+    // Guarded by the looper lock.
+    std::vector<Registration> mRegistrations;  // indexed by fd
+    std::vector<pollfd> mPollFds;
+    std::vector<int> mFds;
+    // Set by changes.  Sequentially consistent, like Looper::mPolling, so that a change
+    // either sees that the looper is polling and wakes it, or the looper sees the change.
+    std::atomic<bool> mChanged{false};
+
+    // The set of the current wait, only used by the polling thread.
+    std::vector<pollfd> mWaitFds;
+    std::vector<uint64_t> mWaitSeqs;
+    size_t mNextIndex = 0;
+    std::vector<int> mReportedFds;  // of the events of the last wait
+};
+
+}  // namespace
+
+#if HAVE_IO_URING
+// --- IoUringBackend ---
+
+namespace {
+
+// The number of submission entries of the ring.  Requests beyond that are submitted in
+// chunks.
+constexpr unsigned IO_URING_ENTRIES = 256;
+
+// Polls with io_uring.  Registration changes are queued in the submission ring and reach
+// the kernel with the next wait, or with flushChanges() when they come from another thread,
+// so that any number of them costs at most one system call.
+//
+// Multishot polls keep reporting until removed, which is what an edge-triggered
+// registration wants.  A level-triggered registration instead gets a single-shot poll that
+// is queued again before the wait after it reported, once its callback had a chance to
+// consume the readiness, so that an fd that is still ready reports again.  A one-shot
+// registration is polled again by repollFd().
+//
+// Each poll has its own sequence number, from generations per fd, so that the completions
+// of polls that were replaced meanwhile are told apart and dropped.
+class IoUringBackend : public PollBackend {
+public:
+    IoUringBackend(std::unique_ptr<IoUringPoller> poller, std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls)
+        : PollBackend(Looper::POLL_BACKEND_IO_URING, waitSyscalls, registrationSyscalls),
+          mPoller(std::move(poller)) {}
+
+    int addFd(int fd, int events, uint64_t seq) override {
+        if (fd < 0) {
+            return EBADF;
+        }
+        if (findRegistration(mRegistrations, fd) != nullptr) {
+            return EEXIST;
+        }
+        if (static_cast<size_t>(fd) >= mRegistrations.size()) {
+            mRegistrations.resize(fd + 1);
+        }
+        Registration& registration = mRegistrations[fd];
+        registration.seq = seq;
+        registration.events = events;
+        return queuePoll(fd, registration);
+    }
+
+    int modifyFd(int fd, int, int events, uint64_t seq) override {
+        Registration* registration = findRegistration(mRegistrations, fd);
+        if (registration == nullptr) {
+            return ENOENT;
+        }
+        // The earlier poll is cancelled in the same submission.
+        queueRemove(registration->pollSeq);
+        registration->seq = seq;
+        registration->events = events;
+        return queuePoll(fd, *registration);
+    }
+
+    int removeFd(int fd, int, uint64_t) override {
+        Registration* registration = findRegistration(mRegistrations, fd);
+        if (registration == nullptr) {
+            return ENOENT;
+        }
+        queueRemove(registration->pollSeq);
+        registration->seq = 0;
+        registration->pollSeq = 0;
+        return 0;
+    }
+
+    bool flushChanges() override {
+        return countSubmits([&] { return mPoller->submit(); });
+    }
+
+    bool needsPrepareWait() const override { return !mEndedPolls.empty(); }
+
+    void prepareWaitLocked() override {
+        for (uint64_t pollSeq : mEndedPolls) {
+            // Skip polls that were replaced or removed meanwhile, and one-shot registrations.
+            const int fd = static_cast<int>(static_cast<uint32_t>(pollSeq));
+            Registration* registration = findRegistration(mRegistrations, fd);
+            if (registration != nullptr && registration->pollSeq == pollSeq
+                    && !(registration->events & Looper::EVENT_ONESHOT)) {
+                queuePoll(fd, *registration);
+            }
+        }
+        mEndedPolls.clear();
+    }
+
+    int wait(PollEvent* events, int maxEvents, nsecs_t timeoutNanos) override {
+        if (mEventItems.size() < static_cast<size_t>(maxEvents)) {
+            mEventItems.resize(maxEvents);
+        }
+        const uint64_t syscallCount = mPoller->getWaitSyscallCount();
+        const int eventCount = mPoller->wait(mEventItems.data(), maxEvents, timeoutNanos,
+                &mEndedPolls);
+        countWaitSyscalls(mPoller->getWaitSyscallCount() - syscallCount);
+        // The events carry the sequence numbers of the polls until they are resolved.
+        for (int i = 0; i < eventCount; i++) {
+            events[i] = {.seq = mEventItems[i].userData,
+                         .events = getLooperEventsFromPoll(mEventItems[i].events)};
+        }
+        return eventCount;
+    }
+
+    int resolveEventsLocked(PollEvent* events, int eventCount) override {
+        int resolvedCount = 0;
+        for (int i = 0; i < eventCount; i++) {
+            const uint64_t pollSeq = events[i].seq;
+            const int fd = static_cast<int>(static_cast<uint32_t>(pollSeq));
+            const Registration* registration = findRegistration(mRegistrations, fd);
+            if (registration == nullptr || registration->pollSeq != pollSeq) {
+                continue;
+            }
+            events[resolvedCount++] = {.seq = registration->seq, .events = events[i].events};
+        }
+        return resolvedCount;
+    }
+
+private:
+    struct Registration {
+        uint64_t seq = 0;  // 0 when the fd is not registered
+        int events = 0;
+        uint64_t pollSeq = 0;  // of the queued poll
+        uint32_t generation = 0;
+    };
+
+    // Counts the system calls the poller makes to hand over requests.
+    template <typename F>
+    bool countSubmits(F f) {
+        const uint64_t syscallCount = mPoller->getSubmitSyscallCount();
+        const bool result = f();
+        countRegistrationSyscalls(mPoller->getSubmitSyscallCount() - syscallCount);
+        return result;
+    }
+
+    int queuePoll(int fd, Registration& registration) {
+        if (++registration.generation == 0) registration.generation = 1;
+        registration.pollSeq = (static_cast<uint64_t>(registration.generation) << 32)
+                | static_cast<uint32_t>(fd);
+        const bool multishot = (registration.events
+                & (Looper::EVENT_EDGE_TRIGGERED | Looper::EVENT_ONESHOT))
+                == Looper::EVENT_EDGE_TRIGGERED;
+        const bool queued = countSubmits([&] {
+            return mPoller->queuePoll(fd, getPollEvents(registration.events),
+                    registration.pollSeq, multishot);
+        });
+        return queued ? 0 : EAGAIN;
+    }
+
+    void queueRemove(uint64_t pollSeq) {
+        countSubmits([&] { return mPoller->queueRemove(pollSeq); });
+    }
+
+    const std::unique_ptr<IoUringPoller> mPoller;
+    std::vector<Registration> mRegistrations;  // indexed by fd, guarded by the looper lock
+
+    // Only used by the polling thread.
+    std::vector<IoUringPoller::Event> mEventItems;
+    std::vector<uint64_t> mEndedPolls;  // the sequence numbers of polls to queue again
+};
+
+}  // namespace
+#endif
+
+// --- PollBackend ---
+
+void PollBackend::applyChanges(PollChange* changes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        PollChange& change = changes[i];
+        switch (change.op) {
+            case PollChange::ADD:
+                change.result = addFd(change.fd, change.events, change.seq);
+                break;
+            case PollChange::MODIFY:
+                change.result = modifyFd(change.fd, change.oldEvents, change.events, change.seq);
+                break;
+            case PollChange::REMOVE:
+                change.result = removeFd(change.fd, change.events, change.seq);
+                break;
+        }
+    }
+}
+
+std::unique_ptr<PollBackend> PollBackend::create(int type, std::atomic<uint64_t>* waitSyscalls,
+        std::atomic<uint64_t>* registrationSyscalls) {
+    if (type == Looper::POLL_BACKEND_DEFAULT) {
+#if HAVE_EPOLL
+        type = Looper::POLL_BACKEND_EPOLL;
+#elif HAVE_KQUEUE
+        type = Looper::POLL_BACKEND_KQUEUE;
+#else
+        type = Looper::POLL_BACKEND_POLL;
+#endif
+    }
+
+    switch (type) {
+#if HAVE_EPOLL
+        case Looper::POLL_BACKEND_EPOLL: {
+            android::base::unique_fd epollFd(epoll_create1(EPOLL_CLOEXEC));
+            if (epollFd.get() < 0) {
+                return nullptr;
+            }
+            return std::make_unique<EpollBackend>(std::move(epollFd), waitSyscalls,
+                    registrationSyscalls);
+        }
+#endif
+#if HAVE_KQUEUE
+        case Looper::POLL_BACKEND_KQUEUE: {
+            android::base::unique_fd kqueueFd(kqueue());
+            if (kqueueFd.get() < 0) {
+                return nullptr;
+            }
+            return std::make_unique<KqueueBackend>(std::move(kqueueFd), waitSyscalls,
+                    registrationSyscalls);
+        }
+#endif
+#if HAVE_IO_URING
+        case Looper::POLL_BACKEND_IO_URING: {
+            std::unique_ptr<IoUringPoller> poller = IoUringPoller::create(IO_URING_ENTRIES);
+            if (poller == nullptr) {
+                errno = ENOSYS;
+                return nullptr;
+            }
+            return std::make_unique<IoUringBackend>(std::move(poller), waitSyscalls,
+                    registrationSyscalls);
+        }
+#endif
+        case Looper::POLL_BACKEND_POLL:
+            return std::make_unique<PosixPollBackend>(waitSyscalls, registrationSyscalls);
+        default:
+            errno = ENOTSUP;
+            return nullptr;
+    }
+}
+
+} // namespace android
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_POLL_BACKEND_H
+#define ANDROID_POLL_BACKEND_H
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <utils/Timers.h>
+
+// ---------------------------------------------------------------------------
+
+namespace android {
+
+/*
+ * A file descriptor event reported by a PollBackend.
+ */
+struct PollEvent {
+    uint64_t seq;  // the sequence number the file descriptor is registered with
+    int events;    // Looper::EVENT_* flags
+};
+
+/*
+ * A registration change for PollBackend::applyChanges().
+ */
+struct PollChange {
+    enum Op { ADD, MODIFY, REMOVE };
+
+    Op op;
+    int fd;
+    int oldEvents;  // for MODIFY, the events fd is registered for
+    int events;     // for REMOVE, the events fd is registered for
+    uint64_t seq;
+    int result;     // set by applyChanges(), 0 or an errno value
+};
+
+/*
+ * The kernel interface through which a Looper waits for file descriptor events, one of
+ * Looper::POLL_BACKEND_*.
+ *
+ * Registrations take Looper::EVENT_* flags, including EVENT_EDGE_TRIGGERED and
+ * EVENT_ONESHOT, and the sequence number that events of the file descriptor are reported
+ * with.  They return 0 or an errno value.
+ *
+ * The looper calls the registration methods and the *Locked() methods with its lock held,
+ * from any thread, and wait() without it, only from the thread polling it.
+ */
+class PollBackend
+{
+public:
+    /* Returns nullptr, with errno set, if the backend is unavailable.  System calls are
+     * counted into the given counters, which must outlive the backend. */
+    static std::unique_ptr<PollBackend> create(int type, std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls);
+
+    virtual ~PollBackend() = default;
+
+    int getType() const { return mType; }
+
+    virtual int addFd(int fd, int events, uint64_t seq) = 0;
+
+    /* Replaces the registration of fd, which was registered for oldEvents. */
+    virtual int modifyFd(int fd, int oldEvents, int events, uint64_t seq) = 0;
+
+    virtual int removeFd(int fd, int events, uint64_t seq) = 0;
+
+    /* Applies the changes in order, with as few system calls as the kernel interface
+     * allows, and stores the result of each.  Each fd may appear in one change only. */
+    virtual void applyChanges(PollChange* changes, size_t count);
+
+    /* Arms a one-shot registration again after it reported. */
+    virtual int repollFd(int fd, int events, uint64_t seq) {
+        return modifyFd(fd, events, events, seq);
+    }
+
+    /* Whether a registration can outlive its fd, for as long as the file it refers to is
+     * open elsewhere.  Once the fd is closed or reused, such a registration can no longer
+     * be modified or removed, only dropped along with the whole backend. */
+    virtual bool keepsRegistrationsOfClosedFds() const { return false; }
+
+    /* Makes registration changes take effect for a wait that is already blocked.  Returns
+     * false if that takes waking the looper. */
+    virtual bool flushChanges() { return true; }
+
+    /* Whether prepareWaitLocked() has anything to do, called on the polling thread. */
+    virtual bool needsPrepareWait() const { return false; }
+
+    /* Brings the registrations up to date for the next wait. */
+    virtual void prepareWaitLocked() {}
+
+    /* Waits up to timeoutNanos, or forever if it is negative, for events.  Returns the
+     * number of events stored, or -1 with errno set. */
+    virtual int wait(PollEvent* events, int maxEvents, nsecs_t timeoutNanos) = 0;
+
+    /* Drops the events of the last wait that are stale by now, returns how many are left. */
+    virtual int resolveEventsLocked(PollEvent* /*events*/, int eventCount) {
+        return eventCount;
+    }
+
+protected:
+    PollBackend(int type, std::atomic<uint64_t>* waitSyscalls,
+            std::atomic<uint64_t>* registrationSyscalls)
+        : mType(type), mWaitSyscalls(waitSyscalls), mRegistrationSyscalls(registrationSyscalls) {}
+
+    // The wait counter only has the polling thread as writer, the registration counter is
+    // only written with the looper lock held.
+    void countWaitSyscalls(uint64_t count = 1) {
+        mWaitSyscalls->store(mWaitSyscalls->load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+    }
+    void countRegistrationSyscalls(uint64_t count = 1) {
+        mRegistrationSyscalls->store(
+                mRegistrationSyscalls->load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+    }
+
+private:
+    const int mType;
+    std::atomic<uint64_t>* const mWaitSyscalls;
+    std::atomic<uint64_t>* const mRegistrationSyscalls;
+};
+
+} // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_POLL_BACKEND_H
@@ -18,18 +18,18 @@
 #define UTILS_LOOPER_H
 
 
+#include <atomic>
 #include <unordered_map>
 #include <utility>
 #include <memory>
+#include <vector>
 #include <utils/RefBase.h>
 #include <utils/Timers.h>
 #include <utils/unique_fd.h>
 #include <utils/Mutex.h>
 #include <utils/Vector.h>
 
-#if HAVE_EPOLL
-#include <sys/epoll.h>
-#elif HAVE_KQUEUE
+#if HAVE_KQUEUE
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
@@ -37,6 +37,11 @@
 #endif
 
 namespace android {
+
+class PollBackend;
+struct PollChange;
+struct PollEvent;
+
 /*
  * NOTE: Since Looper is used to implement the NDK ALooper, the Looper
  * enums and the signature of Looper_callbackFunc need to align with
@@ -123,6 +128,38 @@ public:
     virtual int handleEvent(int fd, int events, void* data) = 0;
 };
 
+/**
+ * Receives reports of slow callbacks and late messages from a looper, see
+ * Looper::setWatchdog().
+ *
+ * The methods are called on the looper's thread, without holding any lock, right after
+ * the slow callback returned or right before the late message is handled.
+ */
+class LooperWatchdog : public virtual RefBase {
+protected:
+    virtual ~LooperWatchdog();
+
+public:
+    /**
+     * Reports that the callback for an event on the given file descriptor took the
+     * given time in nanoseconds.  The file descriptor may already have been closed.
+     */
+    virtual void onSlowCallback(int fd, int events, nsecs_t duration) = 0;
+
+    /**
+     * Reports that the handler took the given time in nanoseconds to handle the message.
+     */
+    virtual void onSlowMessage(const sp<MessageHandler>& handler, int what,
+            nsecs_t duration) = 0;
+
+    /**
+     * Reports that the message is being handled the given time in nanoseconds after
+     * its uptime.
+     */
+    virtual void onLateMessage(const sp<MessageHandler>& handler, int what,
+            nsecs_t lateness) = 0;
+};
+
 /**
  * Wraps a Looper_callbackFunc function pointer.
  */
@@ -217,8 +254,74 @@ public:
          * to specify this event flag in the requested event set.
          */
         EVENT_INVALID = 1 << 4,
+
+        /**
+         * Registration flag for addFd(): report the events of the file descriptor
+         * edge-triggered rather than level-triggered, that is only when it becomes ready
+         * again rather than for as long as it is ready.  The caller must then consume all
+         * available data, for example by reading until EAGAIN, before waiting again.
+         */
+        EVENT_EDGE_TRIGGERED = 1 << 5,
+
+        /**
+         * Registration flag for addFd(): stop reporting events for the file descriptor
+         * after the first one, until it is re-armed with repoll() or by adding it again.
+         * The file descriptor stays registered until it is removed.
+         */
+        EVENT_ONESHOT = 1 << 6,
     };
 
+    /**
+     * Flags for addTimer().
+     */
+    enum {
+        /**
+         * When the looper falls more than a period behind, deliver a single tick for all
+         * the missed ones and resume on the original schedule.  By default the missed
+         * ticks are delivered back to back until the timer has caught up.
+         */
+        TIMER_SKIP_MISSED = 1 << 0,
+    };
+
+    /**
+     * Priority classes of messages.  Due messages are handled in order of priority, but a
+     * message waits at most Options::messagePriorityAging for each class above its own:
+     * past that, it goes before messages of higher priority that became due later.
+     */
+    enum {
+        MESSAGE_PRIORITY_URGENT = 0,
+        MESSAGE_PRIORITY_NORMAL = 1,
+        MESSAGE_PRIORITY_BACKGROUND = 2,
+    };
+
+    /**
+     * Kernel interfaces to wait for file descriptor events with, see Options::pollBackend.
+     */
+    enum {
+        /** epoll where available, otherwise kqueue, otherwise poll(2). */
+        POLL_BACKEND_DEFAULT = 0,
+        POLL_BACKEND_EPOLL = 1,
+        POLL_BACKEND_KQUEUE = 2,
+        /**
+         * poll(2), available everywhere.  Registrations cost no system call, but changes
+         * made from other threads wake the looper, and each poll costs time linear in the
+         * number of file descriptors.  Does not support EVENT_EDGE_TRIGGERED, and polls
+         * with millisecond precision.
+         */
+        POLL_BACKEND_POLL = 3,
+        /**
+         * io_uring, on Linux.  Registration changes are batched into the next poll, or a
+         * single submission when made from another thread, instead of costing a system
+         * call each.
+         */
+        POLL_BACKEND_IO_URING = 4,
+    };
+
+    /**
+     * Identifies a timer added with addTimer().  Never 0.
+     */
+    using TimerId = uint64_t;
+
     enum {
         /**
          * Option for Looper_prepare: this looper will accept calls to
@@ -230,6 +333,125 @@ public:
         PREPARE_ALLOW_NON_CALLBACKS = 1<<0
     };
 
+    /**
+     * Optional tuning of a looper's behavior, supplied when it is created.
+     */
+    struct Options {
+        /**
+         * If true, sendMessage*() does not take the looper lock.  Messages are pushed
+         * onto a lock-free multi-producer inbox which the looper thread moves into its
+         * message queue each time it polls, and the looper is only woken when the inbox
+         * goes from empty to non-empty.  This avoids contention between posting threads
+         * and the looper thread at the cost of one allocation per message.
+         */
+        bool lockFreeMessagePosting = false;
+
+        /**
+         * The number of file descriptor events retrieved from the kernel by each poll.
+         */
+        size_t eventBatchSize = 16;
+
+        /**
+         * If larger than eventBatchSize, the batch size doubles, up to this limit, each
+         * time a poll returns a full batch, so that a looper watching many busy file
+         * descriptors drains a burst of events with fewer system calls.
+         */
+        size_t maxEventBatchSize = 0;
+
+        /**
+         * How late, in nanoseconds, a message may be handled so that the looper wakes up
+         * once for several messages due around the same time.  When the next message is
+         * due in the future, the looper waits until the last message due within this
+         * window of it, then handles them all in one pass.  Messages that are already due
+         * are never held back.
+         */
+        nsecs_t messageSlack = 0;
+
+        /**
+         * How long, in nanoseconds, a due message defers to due messages of the next
+         * higher priority class, see MESSAGE_PRIORITY_*.
+         */
+        nsecs_t messagePriorityAging = 100000000;
+
+        /**
+         * Limits on the number of messages and on the time in nanoseconds that a poll
+         * spends handling messages, 0 for none.  Once either is reached the remaining due
+         * messages wait for the next poll, which does not block, so that a flood of
+         * messages cannot hold back fd callbacks.
+         */
+        size_t maxMessagesPerPoll = 0;
+        nsecs_t maxMessageTimePerPoll = 0;
+
+        /**
+         * The kernel interface to wait for file descriptor events with, one of
+         * POLL_BACKEND_*.  Falls back to POLL_BACKEND_DEFAULT when it is unavailable.
+         */
+        int pollBackend = POLL_BACKEND_DEFAULT;
+    };
+
+    /**
+     * The number of buckets of Stats::callbackDurationHistogram.
+     */
+    static constexpr size_t CALLBACK_DURATION_BUCKETS = 32;
+
+    /**
+     * A snapshot of a looper's counters, see getStats().
+     */
+    struct Stats {
+        /* The number of times the looper has polled for events. */
+        uint64_t pollCount;
+
+        /* The number of times a poll was woken by wake(). */
+        uint64_t wakeCount;
+
+        /* The total number of events returned by those polls, including wake events. */
+        uint64_t eventCount;
+
+        /* The largest number of events returned by a single poll. */
+        uint64_t maxEventsPerPoll;
+
+        /* The number of polls that returned as many events as the batch could hold. */
+        uint64_t fullEventBatchCount;
+
+        /* The current number of events retrieved by each poll. */
+        size_t eventBatchSize;
+
+        /* The poll backend in use, one of POLL_BACKEND_*. */
+        int pollBackend;
+
+        /* The number of system calls the poll backend made to wait for events and to
+         * register file descriptors. */
+        uint64_t waitSyscallCount;
+        uint64_t registrationSyscallCount;
+
+        /* The number of times the poll set was rebuilt from scratch to get rid of
+         * registrations that outlived their file descriptors. */
+        uint64_t pollSetRebuildCount;
+
+        /* The total time spent blocked waiting for events, in nanoseconds. */
+        nsecs_t blockedTime;
+
+        /* The total time spent handling messages and events after polls, in nanoseconds. */
+        nsecs_t dispatchTime;
+
+        /* The number of messages currently queued, not counting lock-free posts that the
+         * looper has not picked up yet. */
+        size_t messageQueueDepth;
+
+        /* The number of messages that have been dispatched. */
+        uint64_t messageCount;
+
+        /* The total and largest time between the uptime of a message and its dispatch,
+         * in nanoseconds. */
+        nsecs_t totalMessageLateness;
+        nsecs_t maxMessageLateness;
+
+        /* The number of message handler and fd callback invocations by duration: bucket i
+         * counts the ones that took [2^i, 2^(i+1)) nanoseconds, the first bucket also
+         * counts those under a nanosecond and the last one all longer ones. */
+        uint64_t callbackDurationHistogram[CALLBACK_DURATION_BUCKETS];
+    };
+
     /**
      * Creates a looper.
      *
@@ -238,6 +460,7 @@ public:
      * pollOnce() is prepared to handle callback-less events itself.
      */
     Looper(bool allowNonCallbacks);
+    Looper(bool allowNonCallbacks, const Options& options);
 
     /**
      * Returns whether this looper instance allows the registration of file descriptors
@@ -276,6 +499,30 @@ public:
         return pollOnce(timeoutMillis, nullptr, nullptr, nullptr);
     }
 
+    /**
+     * An event of a file descriptor without a callback, see pollBatch().
+     */
+    struct FdEvent {
+        int ident;
+        int fd;
+        int events;
+        void* data;
+    };
+
+    /**
+     * Like pollOnce(), but returns the identifiers of all file descriptors without a
+     * callback that a poll found signalled at once, rather than one per call.
+     *
+     * Returns the number of events stored in outEvents, which holds up to capacity of them.
+     * Events that do not fit are returned by the next call, before polling again.
+     * Otherwise returns POLL_WAKE, POLL_CALLBACK, POLL_TIMEOUT or POLL_ERROR, as pollOnce()
+     * would.
+     *
+     * This method does not return until it has finished invoking the appropriate callbacks
+     * for all file descriptors that were signalled.
+     */
+    int pollBatch(int timeoutMillis, FdEvent* outEvents, size_t capacity);
+
     /**
      * Like pollOnce(), but performs all pending callbacks until all
      * data has been consumed or a file descriptor is available with no callback.
@@ -328,6 +575,30 @@ public:
     int addFd(int fd, int ident, int events, Looper_callbackFunc callback, void* data);
     int addFd(int fd, int ident, int events, const sp<LooperCallback>& callback, void* data);
 
+    /**
+     * A file descriptor registration for addFds(), with the arguments of addFd().
+     */
+    struct FdRegistration {
+        int fd;
+        int ident;
+        int events;
+        sp<LooperCallback> callback;
+        void* data;
+    };
+
+    /**
+     * Adds several file descriptors to be polled by the looper, as if by calling addFd()
+     * for each of them in order, but with a single acquisition of the looper's lock and
+     * with the kernel updates batched as far as the poll backend allows.
+     *
+     * Returns the number of file descriptors added.  Registrations that fail are logged
+     * and skipped, a file descriptor that is listed more than once is counted once.
+     *
+     * This method can be called on any thread.
+     * This method may block briefly if it needs to wake the poll.
+     */
+    size_t addFds(const FdRegistration* registrations, size_t count);
+
     /**
      * May be useful for testing, instead of executing a looper on another thread for code expecting
      * a looper, you can call callbacks directly.
@@ -356,6 +627,19 @@ public:
      */
     int removeFd(int fd);
 
+    /**
+     * Removes several file descriptors from the looper, as if by calling removeFd() for
+     * each of them, but with a single acquisition of the looper's lock and with the kernel
+     * updates batched as far as the poll backend allows.
+     *
+     * Returns the number of file descriptors removed.  File descriptors that were not
+     * registered are skipped.
+     *
+     * This method can be called on any thread.
+     * This method may block briefly if it needs to wake the poll.
+     */
+    size_t removeFds(const int* fds, size_t count);
+
     /**
      * Tell the kernel to check for the same events we're already checking for
      * with this FD. This is to be used when there is a kernel driver bug where
@@ -364,6 +648,9 @@ public:
      * use this in general, and you shouldn't use it unless there is a plan to
      * fix the kernel. See also b/296817256.
      *
+     * This is also how a file descriptor registered with EVENT_ONESHOT is re-armed
+     * after it has reported an event.
+     *
      * Returns 1 if successfully repolled, 0 if not.
      */
     int repoll(int fd);
@@ -371,32 +658,55 @@ public:
     /**
      * Enqueues a message to be processed by the specified handler.
      *
+     * The priority is one of MESSAGE_PRIORITY_*.
      * The handler must not be null.
      * This method can be called on any thread.
      */
-    void sendMessage(const sp<MessageHandler>& handler, const Message& message);
+    void sendMessage(const sp<MessageHandler>& handler, const Message& message,
+            int priority = MESSAGE_PRIORITY_NORMAL);
 
     /**
      * Enqueues a message to be processed by the specified handler after all pending messages
      * after the specified delay.
      *
      * The time delay is specified in uptime nanoseconds.
+     * The priority is one of MESSAGE_PRIORITY_*.
      * The handler must not be null.
      * This method can be called on any thread.
      */
     void sendMessageDelayed(nsecs_t uptimeDelay, const sp<MessageHandler>& handler,
-            const Message& message);
+            const Message& message, int priority = MESSAGE_PRIORITY_NORMAL);
 
     /**
      * Enqueues a message to be processed by the specified handler after all pending messages
      * at the specified time.
      *
      * The time is specified in uptime nanoseconds.
+     * The priority is one of MESSAGE_PRIORITY_*.
      * The handler must not be null.
      * This method can be called on any thread.
      */
     void sendMessageAtTime(nsecs_t uptime, const sp<MessageHandler>& handler,
-            const Message& message);
+            const Message& message, int priority = MESSAGE_PRIORITY_NORMAL);
+
+    /**
+     * A message to be enqueued by sendMessagesAtTime().
+     */
+    struct MessageAtTime {
+        nsecs_t uptime;
+        sp<MessageHandler> handler;
+        Message message;
+        int priority = MESSAGE_PRIORITY_NORMAL;
+    };
+
+    /**
+     * Enqueues a batch of messages, as if by calling sendMessageAtTime() for each of them
+     * in order, but acquiring the looper lock and waking the poll at most once.
+     *
+     * The handlers must not be null.
+     * This method can be called on any thread.
+     */
+    void sendMessagesAtTime(const MessageAtTime* messages, size_t count);
 
     /**
      * Removes all messages for the specified handler from the queue.
@@ -414,6 +724,36 @@ public:
      */
     void removeMessages(const sp<MessageHandler>& handler, int what);
 
+    /**
+     * Adds a timer that sends the given message to the specified handler every period
+     * nanoseconds, starting one period from now, until it is cancelled.
+     *
+     * The ticks are scheduled against absolute deadlines, so the time spent handling
+     * them or any other work does not make the timer drift.  Each tick may be delayed by
+     * up to slack nanoseconds so that it coincides with the ticks of other timers: with a
+     * non-zero slack, deadlines are rounded up to a multiple of the largest power of two
+     * that fits in the slack, which lines up timers of similar slack on the same wakeups.
+     *
+     * "flags" is a combination of TIMER_* flags, or 0.
+     *
+     * The ticks are not removed by removeMessages(), only by cancelTimer().
+     *
+     * The handler must not be null and the period must be positive.
+     * This method can be called on any thread.
+     */
+    TimerId addTimer(nsecs_t period, const sp<MessageHandler>& handler, const Message& message,
+            int flags, nsecs_t slack = 0);
+
+    /**
+     * Cancels a timer added with addTimer().  A tick that is already being handled runs
+     * to completion, but no other tick is delivered once this method returns.
+     *
+     * Returns true if the timer was cancelled, false if it did not exist.
+     *
+     * This method can be called on any thread, including from the handler of the timer.
+     */
+    bool cancelTimer(TimerId timer);
+
     /**
      * Returns whether this looper's thread is currently polling for more work to do.
      * This is a good signal that the loop is still alive rather than being stuck
@@ -422,6 +762,28 @@ public:
      */
     bool isPolling() const;
 
+    /**
+     * Returns a snapshot of this looper's counters.
+     *
+     * The counters are maintained by the polling thread at very little cost and may
+     * be read on any thread, although they are not updated atomically as a whole.
+     */
+    Stats getStats() const;
+
+    /**
+     * Sets the watchdog that is told about fd callbacks and message handlers that take
+     * longer than callbackThreshold and about messages handled more than
+     * latenessThreshold after their uptime, both in nanoseconds.  A threshold of zero
+     * or less disables the corresponding reports and a null watchdog disables all of them.
+     *
+     * The checks only compare the timestamps that the looper takes for getStats()
+     * anyway, so they are cheap enough to leave enabled.
+     *
+     * This method can be called on any thread, it takes effect from the next poll.
+     */
+    void setWatchdog(const sp<LooperWatchdog>& watchdog, nsecs_t callbackThreshold,
+            nsecs_t latenessThreshold);
+
     /**
      * Prepares a looper associated with the calling thread, and returns it.
      * If the thread already has a looper, it is returned.  Otherwise, a new
@@ -431,6 +793,18 @@ public:
      */
     static sp<Looper> prepare(int opts);
 
+    /**
+     * Like prepare(), but first pins the calling thread to the given CPU so that the
+     * looper and everything it dispatches stay on that core.
+     *
+     * On Linux the thread is restricted to that CPU.  On Apple platforms, which have no
+     * hard affinity, the thread gets an affinity tag per CPU that the scheduler treats
+     * as a hint.
+     *
+     * Returns nullptr, without preparing a looper, if the thread could not be pinned.
+     */
+    static sp<Looper> prepareOnCpu(int cpu, int opts);
+
     /**
      * Sets the given looper to be associated with the calling thread.
      * If another looper is already associated with the thread, it is replaced.
@@ -454,72 +828,235 @@ private:
       int events;
       sp<LooperCallback> callback;
       void* data;
-
-#if HAVE_EPOLL
-      uint32_t getEpollEvents() const;
-#elif HAVE_KQUEUE
-      Vector<int16_t> getKqueueFilters() const;
-#endif
     };
 
     struct Response {
         SequenceNumber seq;
         int events;
-        Request request;
+        int ident;
+        int fd;
+        void* data;
+        // Borrowed from the request, see mDeferCallbackReleases.
+        LooperCallback* callback;
     };
 
+    static constexpr uint32_t NO_MESSAGE_SLOT = UINT32_MAX;
+
     struct MessageEnvelope {
-        MessageEnvelope() : uptime(0) { }
+        MessageEnvelope()
+            : uptime(0), seq(0), priority(MESSAGE_PRIORITY_NORMAL), timer(0),
+              prevByHandler(NO_MESSAGE_SLOT), nextByHandler(NO_MESSAGE_SLOT),
+              prevByWhat(NO_MESSAGE_SLOT), nextByWhat(NO_MESSAGE_SLOT) { }
 
-        MessageEnvelope(nsecs_t u, sp<MessageHandler> h, const Message& m)
-            : uptime(u), handler(std::move(h)), message(m) {}
+        nsecs_t uptime;
+        uint64_t seq; // enqueue order, breaks ties between equal uptimes; 0 for a free slot
+        int priority;
+        sp<MessageHandler> handler;
+        Message message;
+        TimerId timer; // the timer this is the next tick of, 0 for a plain message
+
+        // Links of the intrusive lists that index pending messages by handler and by
+        // (handler, what) so that removeMessages() only visits the matching envelopes.
+        uint32_t prevByHandler;
+        uint32_t nextByHandler;
+        uint32_t prevByWhat;
+        uint32_t nextByWhat;
+    };
 
+    // An entry of the pending or ready message heap, referring to the slot of its envelope.
+    // The entry is a tombstone once that slot no longer holds a message with the same seq.
+    // In the ready heap, uptime is the rank of the message, see peekReadyMessageLocked().
+    struct MessageHeapEntry {
         nsecs_t uptime;
+        uint64_t seq;
+        uint32_t slot;
+    };
+
+    struct MessageKey {
+        MessageHandler* handler;
+        int what;
+
+        bool operator==(const MessageKey& other) const {
+            return handler == other.handler && what == other.what;
+        }
+    };
+
+    struct MessageKeyHash {
+        size_t operator()(const MessageKey& key) const {
+            return std::hash<MessageHandler*>()(key.handler) ^ (std::hash<int>()(key.what) << 1);
+        }
+    };
+
+    // A repeating timer.  Its next tick is an envelope in the message heap that is put
+    // back with the following deadline whenever it is dispatched, rather than released.
+    // Ticks are not linked into the handler and what lists, see addTimer().
+    struct Timer {
+        uint32_t slot;
+        nsecs_t period;
+        nsecs_t granularity; // the deadlines are rounded up to a multiple of this, or 0
+        nsecs_t deadline; // the exact time of the next tick, before rounding
+        int flags;
+    };
+
+    // A message posted through the lock-free inbox, see Options::lockFreeMessagePosting.
+    struct InboxMessage {
+        nsecs_t uptime;
+        int priority;
         sp<MessageHandler> handler;
         Message message;
+        InboxMessage* next;
+    };
+
+    // The channel through which wake() interrupts the poll.  Whatever it is built on, it
+    // exposes one file descriptor that polls readable while signalled, signalling it
+    // costs one system call and draining it clears any number of signals at once.
+    class WakeChannel {
+    public:
+        WakeChannel();
+
+        int getFd() const { return mFd.get(); }
+        void signal();
+        void drain();
+
+    private:
+        android::base::unique_fd mFd;
+#if !HAVE_EVENTFD && !HAVE_KQUEUE
+        android::base::unique_fd mWriteFd;  // the write end of the self-pipe
+#endif
     };
 
     const bool mAllowNonCallbacks; // immutable
+    const Options mOptions; // immutable
 
-    android::base::unique_fd mWakeEventFd;  // immutable
+    WakeChannel mWakeChannel;  // immutable
     Mutex mLock;
 
-    Vector<MessageEnvelope> mMessageEnvelopes; // guarded by mLock
+    // Pending messages live in stable slots of mMessageEnvelopes.  mMessageHeap orders
+    // them as a binary min-heap by (uptime, seq) so that posting and dispatching a message
+    // are O(log n) while messages with equal uptimes are still delivered in the order in
+    // which they were sent.  Removed messages release their slot immediately and leave a
+    // tombstone in the heap that is skipped when it reaches the top.  These use std::vector
+    // because Vector reallocates on nearly every pop() once it is less than half full.
+    std::vector<MessageEnvelope> mMessageEnvelopes; // guarded by mLock
+    std::vector<uint32_t> mFreeMessageSlots; // guarded by mLock
+    std::vector<MessageHeapEntry> mMessageHeap; // guarded by mLock
+    // Messages that are due, ordered by priority.  Messages move here from mMessageHeap
+    // as they become due, and usually only stay for the rest of the poll.
+    std::vector<MessageHeapEntry> mReadyMessages; // guarded by mLock
+    size_t mMessageTombstones; // guarded by mLock, in both heaps
+    size_t mPrioritizedMessageCount; // guarded by mLock, pending messages not of normal priority
+    std::unordered_map<MessageHandler*, uint32_t> mMessagesByHandler; // guarded by mLock
+    std::unordered_map<MessageKey, uint32_t, MessageKeyHash> mMessagesByWhat; // guarded by mLock
+    uint64_t mNextMessageSeq; // guarded by mLock
+    std::unordered_map<TimerId, Timer> mTimers; // guarded by mLock, by the seq of their first tick
+
+    // Messages posted without the lock, most recent first.  Any thread may push onto it,
+    // only a holder of mLock may take it.
+    std::atomic<InboxMessage*> mInbox;
     bool mSendingMessage; // guarded by mLock
 
     // Whether we are currently waiting for work.  Not protected by a lock,
-    // any use of it is racy anyway.
-    volatile bool mPolling;
+    // any use of it is racy anyway, except for the pairing with mWakePending.
+    std::atomic<bool> mPolling;
 
-#if HAVE_EPOLL
-    android::base::unique_fd mEpollFd;  // guarded by mLock but only modified on the looper thread
-#elif HAVE_KQUEUE
-    android::base::unique_fd mKqueueFd;  // guarded by mLock but only modified on the looper thread
-#endif
+    // Whether wake() was called since the looper last noticed a wake, in which case
+    // further wakes need not signal mWakeChannel.
+    std::atomic<bool> mWakePending;
+
+    std::unique_ptr<PollBackend> mBackend;  // guarded by mLock but only modified on the looper thread
     bool mEpollRebuildRequired; // guarded by mLock
 
-    // Locked maps of fds and sequence numbers monitoring requests.
-    // Both maps must be kept in sync at all times.
-    std::unordered_map<SequenceNumber, Request> mRequests;               // guarded by mLock
-    std::unordered_map<int /*fd*/, SequenceNumber> mSequenceNumberByFd;  // guarded by mLock
+    // Registrations the backend may still hold because their fd was closed or reused before
+    // they could be removed, by sequence number, with the number of events they reported
+    // since.  See markStaleRegistrationLocked().
+    std::unordered_map<SequenceNumber, uint32_t> mStaleRegistrations; // guarded by mLock
+
+    // Monitoring requests, indexed by fd.  The sequence number of a request encodes its fd
+    // and the slot's generation, which is bumped every time the fd is registered, so that
+    // resolving the sequence number of a polled event is a single indexed load.
+    struct RequestSlot {
+        SequenceNumber seq = 0;  // 0 when the fd is not registered
+        uint32_t generation = 0;
+        Request request;
+    };
+    std::vector<RequestSlot> mRequestSlots;  // guarded by mLock
+    size_t mRequestCount;  // guarded by mLock, the number of registered fds
 
-    // The sequence number to use for the next fd that is added to the looper.
-    // The sequence number 0 is reserved for the WakeEventFd.
-    SequenceNumber mNextRequestSeq;  // guarded by mLock
+    // Set while mResponses borrows request callbacks.  Callbacks of requests that are
+    // removed or replaced meanwhile, including from within a callback, are parked in
+    // mRetiredCallbacks and released once all responses have been dispatched.
+    bool mDeferCallbackReleases;  // guarded by mLock
+    std::vector<sp<LooperCallback>> mRetiredCallbacks;  // guarded by mLock
 
     // This state is only used privately by pollOnce and does not require a lock since
     // it runs on a single thread.
     Vector<Response> mResponses;
     size_t mResponseIndex;
-    nsecs_t mNextMessageUptime; // set to LLONG_MAX when none
+    nsecs_t mNextMessageUptime; // when to wake up for the next messages, LLONG_MAX when none
+    std::vector<PollEvent> mEventItems;
+
+    // Counters behind getStats().  Only the polling thread writes them, other threads
+    // may read them at any time.
+    // messageQueueDepth and registrationSyscallCount are the exception: they are written by
+    // whichever thread holds mLock.
+    struct StatsCounters {
+        std::atomic<uint64_t> pollCount{0};
+        std::atomic<uint64_t> wakeCount{0};
+        std::atomic<uint64_t> eventCount{0};
+        std::atomic<uint64_t> maxEventsPerPoll{0};
+        std::atomic<uint64_t> fullEventBatchCount{0};
+        std::atomic<size_t> eventBatchSize{0};
+        std::atomic<int> pollBackend{POLL_BACKEND_DEFAULT};
+        std::atomic<uint64_t> waitSyscallCount{0};
+        std::atomic<uint64_t> registrationSyscallCount{0};
+        std::atomic<uint64_t> pollSetRebuildCount{0};
+        std::atomic<nsecs_t> blockedTime{0};
+        std::atomic<nsecs_t> dispatchTime{0};
+        std::atomic<size_t> messageQueueDepth{0};
+        std::atomic<uint64_t> messageCount{0};
+        std::atomic<nsecs_t> totalMessageLateness{0};
+        std::atomic<nsecs_t> maxMessageLateness{0};
+        std::atomic<uint64_t> callbackDurationHistogram[CALLBACK_DURATION_BUCKETS] = {};
+    };
+    StatsCounters mStats;
+
+    sp<LooperWatchdog> mWatchdog;  // guarded by mLock
+    nsecs_t mWatchdogCallbackThreshold;  // guarded by mLock, LLONG_MAX when disabled
+    nsecs_t mWatchdogLatenessThreshold;  // guarded by mLock, LLONG_MAX when disabled
 
     int pollInner(int timeoutMillis);
     int removeSequenceNumberLocked(SequenceNumber seq);  // requires mLock
+    bool checkFdRegistration(int fd, int* ident, const sp<LooperCallback>& callback) const;
+    PollChange prepareFdChangeLocked(int fd, int events);  // requires mLock
+    bool commitFdChangeLocked(const PollChange& change, Request&& request);  // requires mLock
+    PollChange detachRequestLocked(RequestSlot& slot);  // requires mLock
+    bool finishFdRemovalLocked(const PollChange& change);  // requires mLock
+    RequestSlot* getRequestSlotLocked(SequenceNumber seq);  // requires mLock
+    RequestSlot* getRequestSlotByFdLocked(int fd);  // requires mLock
+    void pushResponseLocked(SequenceNumber seq, int events, const Request& request);  // requires mLock
+    void releaseCallbackLocked(sp<LooperCallback>&& callback);  // requires mLock
+    nsecs_t recordCallbackDuration(nsecs_t startTime);  // returns the end time
+    bool isOverMessageBudget(size_t messagesHandled, nsecs_t elapsed) const;
+    bool enqueueMessageLocked(nsecs_t uptime, int priority, const sp<MessageHandler>& handler,
+            const Message& message);  // requires mLock
+    const MessageEnvelope* peekMessageLocked();  // requires mLock
+    const MessageEnvelope* peekReadyMessageLocked(nsecs_t now);  // requires mLock
+    void popMessageLocked(nsecs_t now, sp<MessageHandler>* outHandler,
+            Message* outMessage);  // requires mLock
+    uint32_t acquireMessageSlotLocked();  // requires mLock
+    bool pushMessageHeapLocked(nsecs_t uptime, uint64_t seq, uint32_t slot);  // requires mLock
+    sp<MessageHandler> releaseMessageSlotLocked(uint32_t slot);  // requires mLock
+    void unlinkMessageLocked(uint32_t slot);  // requires mLock
+    void compactMessageHeapLocked();  // requires mLock
+    nsecs_t getMessageWakeupTimeLocked(nsecs_t uptime, nsecs_t now);  // requires mLock
+    void drainInboxLocked();  // requires mLock
     void awoken();
     void rebuildEpollLocked();
     void scheduleEpollRebuildLocked();
+    void markStaleRegistrationLocked(SequenceNumber seq);  // requires mLock
+    bool repairStaleRegistrationLocked(int fd, int events, SequenceNumber seq);  // requires mLock
+    void flushBackendChangesLocked();  // requires mLock
 
-    static void initEpollEvent(struct epoll_event* eventItem);
 };
 
 } // namespace android
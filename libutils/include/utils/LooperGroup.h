@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTILS_LOOPER_GROUP_H
+#define UTILS_LOOPER_GROUP_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <utils/Looper.h>
+
+namespace android {
+
+/**
+ * A pool of threads that each poll a looper of their own, and that share the execution
+ * of the messages sent to the group.
+ *
+ * File descriptors are added to the individual loopers, see getLooper(), and their
+ * callbacks run on the thread of that looper.  Messages sent to the group run on any
+ * of the threads: each handler with pending messages is queued on one thread, and
+ * threads that run out of work steal handlers from the others.  The messages of one
+ * handler are handled one at a time, in the order in which they became due, so a
+ * handler never needs to be thread-safe against itself.
+ *
+ * The threads run until stop() is called or the group is destroyed.
+ */
+class LooperGroup : public RefBase {
+protected:
+    virtual ~LooperGroup();
+
+public:
+    /**
+     * Creates a group and starts its threads, one per available CPU if threadCount is 0.
+     */
+    LooperGroup(size_t threadCount);
+
+    /**
+     * Returns the number of threads of the group.
+     */
+    size_t getThreadCount() const;
+
+    /**
+     * Returns the looper polled by the thread with the given index.
+     */
+    const sp<Looper>& getLooper(size_t index) const;
+
+    /**
+     * Enqueues a message to be processed by the specified handler.
+     *
+     * This method can be called on any thread.
+     */
+    void sendMessage(const sp<MessageHandler>& handler, const Message& message);
+
+    /**
+     * Enqueues a message to be processed by the specified handler after the given
+     * delay in nanoseconds.
+     *
+     * This method can be called on any thread.
+     */
+    void sendMessageDelayed(nsecs_t uptimeDelay, const sp<MessageHandler>& handler,
+            const Message& message);
+
+    /**
+     * Enqueues a message to be processed by the specified handler no earlier than
+     * the given uptime.
+     *
+     * This method can be called on any thread.
+     */
+    void sendMessageAtTime(nsecs_t uptime, const sp<MessageHandler>& handler,
+            const Message& message);
+
+    /**
+     * Removes all messages for the specified handler, including delayed ones, from the
+     * group.  A message that is already being handled may still run.
+     *
+     * This method can be called on any thread.
+     */
+    void removeMessages(const sp<MessageHandler>& handler);
+
+    /**
+     * Removes all messages of a particular type for the specified handler, including
+     * delayed ones, from the group.  A message that is already being handled may still
+     * run.
+     *
+     * This method can be called on any thread.
+     */
+    void removeMessages(const sp<MessageHandler>& handler, int what);
+
+    /**
+     * Stops the threads once they finish what they are running and waits for them.
+     * Messages that have not been handled yet are dropped.
+     *
+     * This method must not be called on one of the threads of the group.
+     */
+    void stop();
+
+private:
+    class DelayedMessageHandler;
+
+    // The pending messages of one handler.  A strand is queued on at most one worker
+    // at a time, which is what keeps the handler from running concurrently.
+    struct Strand {
+        sp<MessageHandler> handler;
+        std::deque<Message> messages;  // guarded by LooperGroup::mLock
+        bool running = false;  // guarded by LooperGroup::mLock, queued or being run
+    };
+
+    struct Worker {
+        sp<Looper> looper;
+        std::thread thread;
+        Mutex lock;
+        std::deque<Strand*> runQueue;  // guarded by lock
+        std::atomic<bool> idle{false};
+    };
+
+    // The most messages a worker runs from one strand before letting others go first.
+    static constexpr size_t STRAND_BATCH_SIZE = 32;
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;  // immutable once started
+    std::atomic<bool> mStopping;
+    std::atomic<size_t> mNextWorker;
+
+    Mutex mLock;
+    std::unordered_map<MessageHandler*, std::unique_ptr<Strand>> mStrands;  // guarded by mLock
+    // The forwarders of the handlers with delayed messages, guarded by mLock.  stop()
+    // removes their messages from the loopers, since those may outlive the group.
+    std::unordered_map<MessageHandler*, sp<DelayedMessageHandler>> mDelayedHandlers;
+
+    void threadLoop(size_t index);
+    void schedule(Strand* strand);
+    Strand* takeStrand(size_t index);
+    void runStrand(size_t index, Strand* strand);
+    bool hasQueuedStrands() const;
+    const sp<Looper>& getDelayedMessageLooper(MessageHandler* handler) const;
+    sp<DelayedMessageHandler> forgetDelayedHandlerLocked(
+            DelayedMessageHandler* delayedHandler);  // requires mLock
+};
+
+} // namespace android
+
+#endif // UTILS_LOOPER_GROUP_H
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTILS_LOOPER_ROUTER_H
+#define UTILS_LOOPER_ROUTER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utils/Looper.h>
+
+namespace android {
+
+/**
+ * Distributes file descriptors and messages over a set of loopers, typically one per
+ * core prepared with Looper::prepareOnCpu(), by a hash key: everything with the same
+ * key goes to the same looper, its shard.
+ *
+ * Messages sent from the thread of one of the loopers travel over a single-producer,
+ * single-consumer ring per pair of shards, so posting across cores touches no shared
+ * lock.  A ring that fills up spills into a locked overflow list, in order.  Messages
+ * sent from other threads go through Looper::sendMessage() of the destination.
+ * Messages from one sender to one shard are handled in the order they were sent.
+ */
+class LooperRouter : public RefBase {
+protected:
+    virtual ~LooperRouter();
+
+public:
+    /**
+     * Creates a router over the given loopers, with rings of at least ringCapacity
+     * messages.
+     */
+    LooperRouter(const std::vector<sp<Looper>>& loopers, size_t ringCapacity = 256);
+
+    /**
+     * Returns the number of loopers of the router.
+     */
+    size_t getShardCount() const;
+
+    /**
+     * Returns the index of the looper that handles the given key.
+     */
+    size_t getShardForKey(uint64_t key) const;
+
+    /**
+     * Returns the looper that handles the given key.
+     */
+    const sp<Looper>& getLooperForKey(uint64_t key) const;
+
+    /**
+     * Adds a file descriptor to the looper that handles the given key,
+     * see Looper::addFd().
+     */
+    int addFd(uint64_t key, int fd, int ident, int events, const sp<LooperCallback>& callback,
+            void* data);
+
+    /**
+     * Removes a file descriptor from the looper that handles the given key,
+     * see Looper::removeFd().
+     */
+    int removeFd(uint64_t key, int fd);
+
+    /**
+     * Enqueues a message to be processed by the specified handler on the looper that
+     * handles the given key.
+     *
+     * This method can be called on any thread.
+     */
+    void sendMessage(uint64_t key, const sp<MessageHandler>& handler, const Message& message);
+
+private:
+    class DoorbellCallback;
+
+    struct RoutedMessage {
+        sp<MessageHandler> handler;
+        Message message;
+    };
+
+    // A bounded single-producer, single-consumer queue.
+    class Ring {
+    public:
+        explicit Ring(size_t capacity);
+
+        bool push(const sp<MessageHandler>& handler, const Message& message);  // producer
+        bool pop(RoutedMessage* outMessage);  // consumer
+
+    private:
+        std::vector<RoutedMessage> mSlots;
+        const size_t mMask;
+        alignas(64) std::atomic<size_t> mHead;  // next slot to pop
+        alignas(64) std::atomic<size_t> mTail;  // next slot to push
+    };
+
+    // The messages from one shard to another.
+    struct Channel {
+        explicit Channel(size_t capacity) : ring(capacity) {}
+
+        Ring ring;
+        // Set by the producer while messages wait in the overflow list, so that it keeps
+        // appending there until the consumer took them, rather than overtake them.
+        std::atomic<bool> overflowing{false};
+        Mutex overflowLock;
+        std::vector<RoutedMessage> overflow;  // guarded by overflowLock
+    };
+
+    struct Shard {
+        sp<Looper> looper;
+        android::base::unique_fd doorbellReadFd;
+        android::base::unique_fd doorbellWriteFd;
+        std::atomic<bool> doorbellPending{false};
+        std::vector<std::unique_ptr<Channel>> channels;  // indexed by the producing shard
+    };
+
+    const uint64_t mId;  // tells the routers apart in the per-thread cache of shards
+    const size_t mRingCapacity;
+    std::vector<std::unique_ptr<Shard>> mShards;  // immutable
+
+    size_t getCurrentShard() const;
+    void ringDoorbell(Shard& shard);
+    void drain(size_t index);
+};
+
+} // namespace android
+
+#endif // UTILS_LOOPER_ROUTER_H
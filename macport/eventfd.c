@@ -5,139 +5,178 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
 
 typedef struct {
-    int sock_r;           // Read end of socket pair
-    int sock_w;           // Write end of socket pair
-    uint64_t counter;     // Current counter value
-    int flags;            // Flags (EFD_SEMAPHORE, etc.)
-    pthread_mutex_t lock; // Lock for thread safety
+    _Atomic int sock_r;          // Read end of socket pair, -1 once closed
+    _Atomic int sock_w;          // Write end of socket pair, -1 once closed
+    _Atomic uint64_t counter;    // Current counter value
+    _Atomic int flags;           // Flags (EFD_SEMAPHORE, etc.)
 } eventfd_ctx;
 
-// Table to keep track of all eventfd contexts
-#define MAX_EVENTFDS 1024
-static eventfd_ctx *ctx_table[MAX_EVENTFDS] = {NULL};
+// Table of contexts indexed by the fd returned from eventfd(): a directory of chunks of
+// CTX_CHUNK_SIZE slots.  Everything in it only ever grows, so lookups need no lock and
+// no epoch: chunks are never freed, a grown directory is published with a release store
+// and the directories it replaces are kept for the readers that may still use them (they
+// add up to less than the current one).  Contexts are never freed either: when an
+// eventfd is closed its context stays in the table and is recycled if the fd number
+// comes back.  table_lock only serializes growth.
+#define CTX_CHUNK_SIZE 1024
+#define MIN_CTX_CHUNKS 16
+
+typedef struct {
+    _Atomic(eventfd_ctx *) slots[CTX_CHUNK_SIZE];
+} ctx_chunk;
+
+typedef struct {
+    size_t chunk_count;
+    _Atomic(ctx_chunk *) chunks[];
+} ctx_directory;
+
+static _Atomic(ctx_directory *) ctx_table;
 static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Find context by fd
-static eventfd_ctx *find_ctx(int fd) {
-    pthread_mutex_lock(&table_lock);
-    for (int i = 0; i < MAX_EVENTFDS; i++) {
-        if (ctx_table[i] && ctx_table[i]->sock_r == fd) {
-            eventfd_ctx *ctx = ctx_table[i];
-            pthread_mutex_unlock(&table_lock);
-            return ctx;
-        }
+// Find the slot of fd, or NULL if the table does not reach it yet
+static _Atomic(eventfd_ctx *) *find_slot(int fd) {
+    ctx_directory *directory = atomic_load_explicit(&ctx_table, memory_order_acquire);
+    size_t index = (size_t)fd / CTX_CHUNK_SIZE;
+    if (fd < 0 || !directory || index >= directory->chunk_count) {
+        return NULL;
     }
-    pthread_mutex_unlock(&table_lock);
-    return NULL;
+    ctx_chunk *chunk = atomic_load_explicit(&directory->chunks[index], memory_order_acquire);
+    if (!chunk) {
+        return NULL;
+    }
+    return &chunk->slots[(size_t)fd % CTX_CHUNK_SIZE];
 }
 
-// Add context to table
-static int add_ctx(eventfd_ctx *ctx) {
+// Find or make the slot of fd, growing the table as needed
+static _Atomic(eventfd_ctx *) *add_slot(int fd) {
     pthread_mutex_lock(&table_lock);
-    
-    // Find an empty slot
-    int idx = -1;
-    for (int i = 0; i < MAX_EVENTFDS; i++) {
-        if (ctx_table[i] == NULL) {
-            idx = i;
-            break;
+
+    ctx_directory *directory = atomic_load_explicit(&ctx_table, memory_order_relaxed);
+    size_t index = (size_t)fd / CTX_CHUNK_SIZE;
+    if (!directory || index >= directory->chunk_count) {
+        size_t chunk_count = directory ? directory->chunk_count * 2 : MIN_CTX_CHUNKS;
+        while (chunk_count <= index) {
+            chunk_count *= 2;
+        }
+        ctx_directory *grown =
+                calloc(1, sizeof(ctx_directory) + chunk_count * sizeof(grown->chunks[0]));
+        if (!grown) {
+            pthread_mutex_unlock(&table_lock);
+            return NULL;
         }
+        grown->chunk_count = chunk_count;
+        for (size_t i = 0; directory && i < directory->chunk_count; i++) {
+            atomic_init(&grown->chunks[i],
+                    atomic_load_explicit(&directory->chunks[i], memory_order_relaxed));
+        }
+        atomic_store_explicit(&ctx_table, grown, memory_order_release);
+        directory = grown;
     }
-    
-    if (idx == -1) {
-        pthread_mutex_unlock(&table_lock);
-        errno = EMFILE;
-        return -1;
+
+    ctx_chunk *chunk = atomic_load_explicit(&directory->chunks[index], memory_order_relaxed);
+    if (!chunk) {
+        chunk = calloc(1, sizeof(ctx_chunk));
+        if (!chunk) {
+            pthread_mutex_unlock(&table_lock);
+            return NULL;
+        }
+        atomic_store_explicit(&directory->chunks[index], chunk, memory_order_release);
     }
-    
-    ctx_table[idx] = ctx;
+
     pthread_mutex_unlock(&table_lock);
-    return 0;
+    return &chunk->slots[(size_t)fd % CTX_CHUNK_SIZE];
 }
 
-// Remove context from table
-static void remove_ctx(int fd) {
-    pthread_mutex_lock(&table_lock);
-    for (int i = 0; i < MAX_EVENTFDS; i++) {
-        if (ctx_table[i] && ctx_table[i]->sock_r == fd) {
-            ctx_table[i] = NULL;
-            break;
-        }
+// Find context by fd
+static eventfd_ctx *find_ctx(int fd) {
+    _Atomic(eventfd_ctx *) *slot = find_slot(fd);
+    eventfd_ctx *ctx = slot ? atomic_load_explicit(slot, memory_order_acquire) : NULL;
+    if (!ctx || atomic_load_explicit(&ctx->sock_r, memory_order_relaxed) != fd) {
+        return NULL;
     }
-    pthread_mutex_unlock(&table_lock);
+    return ctx;
+}
+
+// Signal the reader that the counter became non-zero
+static void signal_socket(eventfd_ctx *ctx) {
+    char dummy = 1;
+    send(atomic_load_explicit(&ctx->sock_w, memory_order_relaxed), &dummy, 1, MSG_DONTWAIT);
 }
 
-// Drain socket buffer
-static void drain_socket(int fd) {
+// Drain stale signals from the socket buffer without blocking
+static void drain_socket(eventfd_ctx *ctx) {
     char buffer[128];
-    int flags = fcntl(fd, F_GETFL);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    
-    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    int fd = atomic_load_explicit(&ctx->sock_r, memory_order_relaxed);
+    while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) == sizeof(buffer)) {
         // Just drain the buffer
     }
-    
-    fcntl(fd, F_SETFL, flags);
 }
 
 // Implementation of eventfd
 int eventfd(unsigned int initval, int flags) {
     int sockets[2];
-    
+
     // Use socketpair instead of pipe for better control
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
         return -1;
     }
-    
+
     // Set flags on sockets
     if (flags & EFD_NONBLOCK) {
         fcntl(sockets[0], F_SETFL, O_NONBLOCK);
         fcntl(sockets[1], F_SETFL, O_NONBLOCK);
     }
-    
+
     if (flags & EFD_CLOEXEC) {
         fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
         fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
     }
-    
-    // Create and initialize context
-    eventfd_ctx *ctx = malloc(sizeof(eventfd_ctx));
-    if (!ctx) {
+
+    _Atomic(eventfd_ctx *) *slot = find_slot(sockets[0]);
+    if (!slot) {
+        slot = add_slot(sockets[0]);
+    }
+    if (!slot) {
         close(sockets[0]);
         close(sockets[1]);
         errno = ENOMEM;
         return -1;
     }
-    
-    ctx->sock_r = sockets[0];
-    ctx->sock_w = sockets[1];
-    ctx->counter = initval;
-    ctx->flags = flags;
-    if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
-        free(ctx);
-        close(sockets[0]);
-        close(sockets[1]);
-        return -1;
+
+    // Reuse the context left behind by an earlier eventfd with the same fd, if any.  The
+    // acquire loads pair with its publication and with eventfd_close() on this fd.
+    eventfd_ctx *ctx = atomic_load_explicit(slot, memory_order_acquire);
+    int recycled = ctx != NULL;
+    if (recycled) {
+        atomic_load_explicit(&ctx->sock_r, memory_order_acquire);
     }
-    
-    // Add to table
-    if (add_ctx(ctx) != 0) {
-        pthread_mutex_destroy(&ctx->lock);
-        free(ctx);
-        close(sockets[0]);
-        close(sockets[1]);
-        return -1;
+    if (!recycled) {
+        ctx = malloc(sizeof(eventfd_ctx));
+        if (!ctx) {
+            close(sockets[0]);
+            close(sockets[1]);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    atomic_store_explicit(&ctx->sock_w, sockets[1], memory_order_relaxed);
+    atomic_store_explicit(&ctx->counter, initval, memory_order_relaxed);
+    atomic_store_explicit(&ctx->flags, flags, memory_order_relaxed);
+    atomic_store_explicit(&ctx->sock_r, sockets[0], memory_order_release);
+    if (!recycled) {
+        atomic_store_explicit(slot, ctx, memory_order_release);
     }
-    
+
     // If we have an initial value, we need to signal
     if (initval > 0) {
-        char buf = 1;
-        write(ctx->sock_w, &buf, 1);
+        signal_socket(ctx);
     }
-    
+
     return sockets[0];  // Return the read end of the socket pair
 }
 
@@ -148,40 +187,54 @@ int eventfd_read(int fd, uint64_t *value) {
         errno = EBADF;
         return -1;
     }
-    
-    pthread_mutex_lock(&ctx->lock);
-    
-    if (ctx->counter == 0) {
-        if (ctx->flags & EFD_NONBLOCK) {
-            pthread_mutex_unlock(&ctx->lock);
+
+    int flags = atomic_load_explicit(&ctx->flags, memory_order_relaxed);
+    for (;;) {
+        // Take the whole counter, or one unit of it in semaphore mode
+        uint64_t counter = atomic_load_explicit(&ctx->counter, memory_order_acquire);
+        while (counter != 0) {
+            uint64_t remaining = (flags & EFD_SEMAPHORE) ? counter - 1 : 0;
+            if (atomic_compare_exchange_weak_explicit(&ctx->counter, &counter, remaining,
+                    memory_order_acquire, memory_order_acquire)) {
+                // The writer signals only on the 0 to non-zero transition, so the
+                // signal must be consumed exactly when the counter drops to zero.
+                // A writer racing with the drain may lose its signal: resend it.
+                if (remaining == 0) {
+                    drain_socket(ctx);
+                    if (atomic_load_explicit(&ctx->counter, memory_order_acquire) != 0) {
+                        signal_socket(ctx);
+                    }
+                }
+                *value = (flags & EFD_SEMAPHORE) ? 1 : counter;
+                return 0;
+            }
+        }
+
+        // Drop a signal left behind by a read that raced with a write, so that the
+        // socket does not stay readable while the counter is zero
+        drain_socket(ctx);
+        if (atomic_load_explicit(&ctx->counter, memory_order_acquire) != 0) {
+            continue;
+        }
+
+        if (flags & EFD_NONBLOCK) {
             errno = EAGAIN;
             return -1;
         }
-        
-        // Block until data is available
-        pthread_mutex_unlock(&ctx->lock);
+
+        // Block until data is available.  Only peek at the signal: it belongs to the
+        // counter and is consumed above once the counter drops to zero, so that the fd
+        // stays readable for pollers while units are left in semaphore mode
         char dummy;
-        ssize_t result = read(ctx->sock_r, &dummy, 1);
-        if (result < 0) {
+        ssize_t result = recv(fd, &dummy, 1, MSG_PEEK);
+        if (result == 0) {
+            errno = EBADF;
             return -1;
         }
-        pthread_mutex_lock(&ctx->lock);
-    } else {
-        // Drain any pending signals from the socket
-        drain_socket(ctx->sock_r);
-    }
-    
-    // Handle read based on semaphore flag
-    if (ctx->flags & EFD_SEMAPHORE) {
-        *value = 1;
-        ctx->counter--;
-    } else {
-        *value = ctx->counter;
-        ctx->counter = 0;
-    }
-    
-    pthread_mutex_unlock(&ctx->lock);
-    return 0;
+        if (result < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
 }
 
 // Write to eventfd
@@ -191,34 +244,27 @@ int eventfd_write(int fd, uint64_t value) {
         errno = EBADF;
         return -1;
     }
-    
+
     if (value == UINT64_MAX) {
         errno = EINVAL;
         return -1;
     }
-    
-    pthread_mutex_lock(&ctx->lock);
-    
-    uint64_t old_counter = ctx->counter;
-    if (UINT64_MAX - old_counter < value) {
-        pthread_mutex_unlock(&ctx->lock);
-        errno = EAGAIN;
-        return -1;
-    }
-    
-    // Update counter
-    ctx->counter += value;
-    
-    // Signal any waiting readers
-    char dummy = 1;
-    ssize_t result = write(ctx->sock_w, &dummy, 1);
-    
-    pthread_mutex_unlock(&ctx->lock);
-    
-    if (result < 0) {
-        return -1;
+
+    uint64_t old_counter = atomic_load_explicit(&ctx->counter, memory_order_relaxed);
+    do {
+        if (UINT64_MAX - old_counter < value) {
+            errno = EAGAIN;
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ctx->counter, &old_counter,
+            old_counter + value, memory_order_release, memory_order_relaxed));
+
+    // Signal any waiting readers, only the first write since the counter was
+    // last emptied needs to
+    if (old_counter == 0 && value != 0) {
+        signal_socket(ctx);
     }
-    
+
     return 0;
 }
 
@@ -229,13 +275,12 @@ int eventfd_close(int fd) {
         errno = EBADF;
         return -1;
     }
-    
-    // Clean up
-    close(ctx->sock_r);
-    close(ctx->sock_w);
-    pthread_mutex_destroy(&ctx->lock);
-    remove_ctx(fd);
-    free(ctx);
-    
+
+    // Clean up, keeping the context in the table for the next eventfd on this fd
+    int sock_w = atomic_exchange_explicit(&ctx->sock_w, -1, memory_order_relaxed);
+    atomic_store_explicit(&ctx->sock_r, -1, memory_order_release);
+    close(fd);
+    close(sock_w);
+
     return 0;
-}
\ No newline at end of file
+}
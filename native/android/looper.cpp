@@ -19,9 +19,14 @@
 
 #include <android/looper.h>
 #include <utils/Looper.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
 // #include <binder/IPCThreadState.h>
 
 using android::Looper;
+using android::SimpleLooperCallback;
 using android::sp;
 // using android::IPCThreadState;
 
@@ -60,6 +65,23 @@ int ALooper_pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outDa
     return looper->pollOnce(timeoutMillis, outFd, outEvents, outData);
 }
 
+int ALooper_pollBatch(int timeoutMillis, ALooperEvent* outEvents, size_t capacity) {
+    static_assert(sizeof(ALooperEvent) == sizeof(Looper::FdEvent)
+            && offsetof(ALooperEvent, ident) == offsetof(Looper::FdEvent, ident)
+            && offsetof(ALooperEvent, fd) == offsetof(Looper::FdEvent, fd)
+            && offsetof(ALooperEvent, events) == offsetof(Looper::FdEvent, events)
+            && offsetof(ALooperEvent, data) == offsetof(Looper::FdEvent, data));
+    sp<Looper> looper = Looper::getForThread();
+    if (looper == NULL) {
+        ALOGE("ALooper_pollBatch: No looper for this thread!");
+        return ALOOPER_POLL_ERROR;
+    }
+
+    // IPCThreadState::self()->flushCommands();
+    return looper->pollBatch(timeoutMillis, reinterpret_cast<Looper::FdEvent*>(outEvents),
+            capacity);
+}
+
 int ALooper_pollAll(int timeoutMillis, int* outFd, int* outEvents, void** outData) {
     sp<Looper> looper = Looper::getForThread();
     if (looper == NULL) {
@@ -80,6 +102,55 @@ int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
     return ALooper_to_Looper(looper)->addFd(fd, ident, events, callback, data);
 }
 
+size_t ALooper_addFds(ALooper* looper, const ALooperFdRegistration* registrations,
+        size_t count) {
+    std::vector<Looper::FdRegistration> looperRegistrations(count);
+    for (size_t i = 0; i < count; i++) {
+        const ALooperFdRegistration& registration = registrations[i];
+        looperRegistrations[i] = {
+            .fd = registration.fd,
+            .ident = registration.ident,
+            .events = registration.events,
+            .callback = registration.callback
+                    ? sp<SimpleLooperCallback>::make(registration.callback) : nullptr,
+            .data = registration.data,
+        };
+    }
+    return ALooper_to_Looper(looper)->addFds(looperRegistrations.data(), count);
+}
+
 int ALooper_removeFd(ALooper* looper, int fd) {
     return ALooper_to_Looper(looper)->removeFd(fd);
-}
\ No newline at end of file
+}
+
+size_t ALooper_removeFds(ALooper* looper, const int* fds, size_t count) {
+    return ALooper_to_Looper(looper)->removeFds(fds, count);
+}
+
+void ALooper_getStats(ALooper* looper, ALooperStats* outStats) {
+    static_assert(ALOOPER_CALLBACK_DURATION_BUCKETS == Looper::CALLBACK_DURATION_BUCKETS);
+    static_assert(int(ALOOPER_POLL_BACKEND_EPOLL) == Looper::POLL_BACKEND_EPOLL);
+    static_assert(int(ALOOPER_POLL_BACKEND_KQUEUE) == Looper::POLL_BACKEND_KQUEUE);
+    static_assert(int(ALOOPER_POLL_BACKEND_POLL) == Looper::POLL_BACKEND_POLL);
+    static_assert(int(ALOOPER_POLL_BACKEND_IO_URING) == Looper::POLL_BACKEND_IO_URING);
+    const Looper::Stats stats = ALooper_to_Looper(looper)->getStats();
+    *outStats = {};
+    outStats->pollCount = stats.pollCount;
+    outStats->wakeCount = stats.wakeCount;
+    outStats->eventCount = stats.eventCount;
+    outStats->maxEventsPerPoll = stats.maxEventsPerPoll;
+    outStats->fullEventBatchCount = stats.fullEventBatchCount;
+    outStats->eventBatchSize = stats.eventBatchSize;
+    outStats->pollBackend = stats.pollBackend;
+    outStats->waitSyscallCount = stats.waitSyscallCount;
+    outStats->registrationSyscallCount = stats.registrationSyscallCount;
+    outStats->pollSetRebuildCount = stats.pollSetRebuildCount;
+    outStats->blockedTime = stats.blockedTime;
+    outStats->dispatchTime = stats.dispatchTime;
+    outStats->messageQueueDepth = stats.messageQueueDepth;
+    outStats->messageCount = stats.messageCount;
+    outStats->totalMessageLateness = stats.totalMessageLateness;
+    outStats->maxMessageLateness = stats.maxMessageLateness;
+    std::copy(std::begin(stats.callbackDurationHistogram), std::end(stats.callbackDurationHistogram),
+            outStats->callbackDurationHistogram);
+}
@@ -26,6 +26,8 @@
 #ifndef ANDROID_LOOPER_H
 #define ANDROID_LOOPER_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/cdefs.h>
 
 #ifdef __cplusplus
@@ -164,6 +166,21 @@ enum {
      * to specify this event flag in the requested event set.
      */
     ALOOPER_EVENT_INVALID = 1 << 4,
+
+    /**
+     * Registration flag for ALooper_addFd(): report the events of the file descriptor
+     * edge-triggered rather than level-triggered, that is only when it becomes ready
+     * again rather than for as long as it is ready.  The caller must then consume all
+     * available data, for example by reading until EAGAIN, before waiting again.
+     */
+    ALOOPER_EVENT_EDGE_TRIGGERED = 1 << 5,
+
+    /**
+     * Registration flag for ALooper_addFd(): stop reporting events for the file
+     * descriptor after the first one, until it is re-armed by adding it again.
+     * The file descriptor stays registered until it is removed.
+     */
+    ALOOPER_EVENT_ONESHOT = 1 << 6,
 };
 
 /**
@@ -215,6 +232,35 @@ typedef int (*ALooper_callbackFunc)(int fd, int events, void* data);
  */
 int ALooper_pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outData);
 
+/**
+ * An event of a file descriptor without a callback, see ALooper_pollBatch().
+ */
+typedef struct ALooperEvent {
+    /** The identifier the file descriptor was added with. */
+    int ident;
+    int fd;
+    /** The poll events, a combination of ALOOPER_EVENT_* flags. */
+    int events;
+    /** The private data pointer the file descriptor was added with. */
+    void* data;
+} ALooperEvent;
+
+/**
+ * Like ALooper_pollOnce(), but returns the identifiers of all file descriptors without
+ * a callback that a poll found signalled in a single call, rather than one per call.
+ *
+ * Returns the number of events stored in outEvents, which holds up to capacity of them.
+ * Events that do not fit are returned by the next call, before polling again.
+ * Otherwise returns ALOOPER_POLL_WAKE, ALOOPER_POLL_CALLBACK, ALOOPER_POLL_TIMEOUT or
+ * ALOOPER_POLL_ERROR, as ALooper_pollOnce() would.
+ *
+ * **All return values may also imply ALOOPER_POLL_WAKE**, as with ALooper_pollOnce().
+ *
+ * This method does not return until it has finished invoking the appropriate callbacks
+ * for all file descriptors that were signalled.
+ */
+int ALooper_pollBatch(int timeoutMillis, ALooperEvent* outEvents, size_t capacity);
+
 /**
  * Like ALooper_pollOnce(), but performs all pending callbacks until all
  * data has been consumed or a file descriptor is available with no callback.
@@ -275,6 +321,32 @@ void ALooper_wake(ALooper* looper);
 int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
         ALooper_callbackFunc callback, void* data);
 
+/**
+ * A file descriptor registration for ALooper_addFds(), with the arguments of
+ * ALooper_addFd().
+ */
+typedef struct ALooperFdRegistration {
+    int fd;
+    int ident;
+    int events;
+    ALooper_callbackFunc callback;
+    void* data;
+} ALooperFdRegistration;
+
+/**
+ * Adds several file descriptors to be polled by the looper, as if by calling
+ * ALooper_addFd() for each of them in order, but with the kernel updates batched
+ * as far as the platform allows.
+ *
+ * Returns the number of file descriptors added.  Registrations that fail are skipped,
+ * a file descriptor that is listed more than once is counted once.
+ *
+ * This method can be called on any thread.
+ * This method may block briefly if it needs to wake the poll.
+ */
+size_t ALooper_addFds(ALooper* looper, const ALooperFdRegistration* registrations,
+        size_t count);
+
 /**
  * Removes a previously added file descriptor from the looper.
  *
@@ -294,6 +366,94 @@ int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
  */
 int ALooper_removeFd(ALooper* looper, int fd);
 
+/**
+ * Removes several file descriptors from the looper, as if by calling ALooper_removeFd()
+ * for each of them, but with the kernel updates batched as far as the platform allows.
+ *
+ * Returns the number of file descriptors removed.  File descriptors that were not
+ * registered are skipped.
+ *
+ * This method can be called on any thread.
+ * This method may block briefly if it needs to wake the poll.
+ */
+size_t ALooper_removeFds(ALooper* looper, const int* fds, size_t count);
+
+/** The kernel interface a looper waits for events with, see ALooperStats::pollBackend. */
+enum {
+    /** epoll. */
+    ALOOPER_POLL_BACKEND_EPOLL = 1,
+
+    /** kqueue. */
+    ALOOPER_POLL_BACKEND_KQUEUE = 2,
+
+    /** poll(2). */
+    ALOOPER_POLL_BACKEND_POLL = 3,
+
+    /** io_uring. */
+    ALOOPER_POLL_BACKEND_IO_URING = 4,
+};
+
+/** The number of buckets of ALooperStats::callbackDurationHistogram. */
+#define ALOOPER_CALLBACK_DURATION_BUCKETS 32
+
+/**
+ * A snapshot of a looper's counters, see ALooper_getStats().
+ * All durations are in nanoseconds.
+ */
+typedef struct ALooperStats {
+    /** The number of times the looper has polled for events. */
+    uint64_t pollCount;
+    /** The number of times a poll was woken by ALooper_wake(). */
+    uint64_t wakeCount;
+    /** The total number of events returned by those polls, including wake events. */
+    uint64_t eventCount;
+    /** The largest number of events returned by a single poll. */
+    uint64_t maxEventsPerPoll;
+    /** The number of polls that returned as many events as the looper could take at once. */
+    uint64_t fullEventBatchCount;
+    /** The current number of events the looper takes from each poll. */
+    uint64_t eventBatchSize;
+    /**
+     * The kernel interface the looper waits for events with, one of
+     * ALOOPER_POLL_BACKEND_*.  The system call counters below depend on it.
+     */
+    int32_t pollBackend;
+    /** The number of system calls the looper made to wait for events. */
+    uint64_t waitSyscallCount;
+    /** The number of system calls the looper made to register file descriptors. */
+    uint64_t registrationSyscallCount;
+    /** The number of times the looper rebuilt its poll set from scratch. */
+    uint64_t pollSetRebuildCount;
+    /** The total time spent blocked waiting for events. */
+    int64_t blockedTime;
+    /** The total time spent handling messages and events after polls. */
+    int64_t dispatchTime;
+    /** The number of messages currently queued. */
+    uint64_t messageQueueDepth;
+    /** The number of messages that have been dispatched. */
+    uint64_t messageCount;
+    /** The total time between the due time of each message and its dispatch. */
+    int64_t totalMessageLateness;
+    /** The largest time between the due time of a message and its dispatch. */
+    int64_t maxMessageLateness;
+    /**
+     * The number of message and callback invocations by duration: bucket i counts the
+     * ones that took [2^i, 2^(i+1)) nanoseconds, the first bucket also counts those
+     * under a nanosecond and the last one all longer ones.
+     */
+    uint64_t callbackDurationHistogram[ALOOPER_CALLBACK_DURATION_BUCKETS];
+} ALooperStats;
+
+/**
+ * Fills in a snapshot of the counters of the looper.
+ *
+ * The counters are always maintained, at very little cost, by the thread polling the
+ * looper.  They are not updated atomically as a whole.
+ *
+ * This method can be called on any thread.
+ */
+void ALooper_getStats(ALooper* looper, ALooperStats* outStats);
+
 #ifdef __cplusplus
 };
 #endif